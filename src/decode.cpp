@@ -0,0 +1,495 @@
+#include "decode.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+// === Trazas de captura ===
+std::vector<uint8_t> encodeTraceHeader() {
+  std::vector<uint8_t> header(TRACE_HEADER_SIZE, 0);
+  std::memcpy(header.data(), TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  header[4] = TRACE_VERSION & 0xff;
+  header[5] = TRACE_VERSION >> 8;
+  return header;
+}
+
+// Los datos de más de 64 KiB se truncan: la longitud se guarda en 16 bits.
+std::vector<uint8_t> encodeTraceRecord(const TraceRecord &rec) {
+  size_t len = std::min<size_t>(rec.data.size(), 0xffff);
+  std::vector<uint8_t> buf(TRACE_RECORD_HEADER_SIZE + len);
+  for (int i = 0; i < 8; ++i)
+    buf[i] = (rec.timestamp_us >> (8 * i)) & 0xff;
+  buf[8] = rec.type;
+  buf[9] = rec.unit;
+  buf[10] = len & 0xff;
+  buf[11] = (len >> 8) & 0xff;
+  if (len > 0)
+    std::memcpy(buf.data() + TRACE_RECORD_HEADER_SIZE, rec.data.data(), len);
+  return buf;
+}
+
+std::vector<TraceRecord> loadTrace(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in.is_open())
+    throw std::runtime_error("No se pudo abrir la traza: " + path);
+  std::vector<char> bytes((std::istreambuf_iterator<char>(in)),
+                          std::istreambuf_iterator<char>());
+  if (bytes.size() < TRACE_HEADER_SIZE ||
+      std::memcmp(bytes.data(), TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0)
+    throw std::runtime_error("Cabecera de traza inválida: " + path);
+
+  auto u8 = [&](size_t i) { return static_cast<uint8_t>(bytes[i]); };
+  uint16_t version = u8(4) | (u8(5) << 8);
+  if (version != TRACE_VERSION)
+    throw std::runtime_error("Versión de traza no soportada: " +
+                             std::to_string(version));
+
+  std::vector<TraceRecord> records;
+  size_t pos = TRACE_HEADER_SIZE;
+  while (pos + TRACE_RECORD_HEADER_SIZE <= bytes.size()) {
+    TraceRecord rec;
+    for (int i = 0; i < 8; ++i)
+      rec.timestamp_us |= static_cast<uint64_t>(u8(pos + i)) << (8 * i);
+    rec.type = u8(pos + 8);
+    rec.unit = u8(pos + 9);
+    size_t len = u8(pos + 10) | (u8(pos + 11) << 8);
+    pos += TRACE_RECORD_HEADER_SIZE;
+    if (pos + len > bytes.size())
+      break; // Registro truncado al final del fichero
+    rec.data.assign(bytes.data() + pos, len);
+    pos += len;
+    records.push_back(std::move(rec));
+  }
+  return records;
+}
+
+uint64_t traceValidSize(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  char header[TRACE_HEADER_SIZE];
+  if (!in.read(header, sizeof(header)) ||
+      std::memcmp(header, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0)
+    return 0;
+  uint16_t version = static_cast<uint8_t>(header[4]) |
+                     (static_cast<uint8_t>(header[5]) << 8);
+  if (version != TRACE_VERSION)
+    return 0;
+
+  in.seekg(0, std::ios::end);
+  uint64_t size = static_cast<uint64_t>(in.tellg());
+  uint64_t pos = TRACE_HEADER_SIZE;
+  unsigned char rec[TRACE_RECORD_HEADER_SIZE];
+  while (pos + TRACE_RECORD_HEADER_SIZE <= size) {
+    in.seekg(pos);
+    if (!in.read(reinterpret_cast<char *>(rec), sizeof(rec)))
+      break;
+    uint64_t end = pos + TRACE_RECORD_HEADER_SIZE + (rec[10] | (rec[11] << 8));
+    if (end > size)
+      break;
+    pos = end;
+  }
+  return pos;
+}
+
+// === Tramas ===
+// CRC-16/XMODEM (poly 0x1021, init 0) tal y como lo usa el protocolo
+// Voltronic: los bytes reservados '(', CR y LF se incrementan en uno.
+uint16_t crc16Voltronic(const uint8_t *data, size_t len) {
+  uint16_t crc = 0;
+  for (size_t i = 0; i < len; ++i) {
+    crc ^= static_cast<uint16_t>(data[i]) << 8;
+    for (int bit = 0; bit < 8; ++bit)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  uint8_t hi = crc >> 8;
+  uint8_t lo = crc & 0xff;
+  if (hi == 0x28 || hi == 0x0D || hi == 0x0A)
+    ++hi;
+  if (lo == 0x28 || lo == 0x0D || lo == 0x0A)
+    ++lo;
+  return (hi << 8) | lo;
+}
+
+std::vector<uint8_t> buildCommand(const std::string &name) {
+  std::vector<uint8_t> cmd(name.begin(), name.end());
+  uint16_t crc = crc16Voltronic(cmd.data(), cmd.size());
+  cmd.push_back(crc >> 8);
+  cmd.push_back(crc & 0xff);
+  cmd.push_back(0x0D);
+  return cmd;
+}
+
+// Valida una trama "(<datos><crc_hi><crc_lo>" (sin CR) y devuelve los datos.
+// La trama empieza en el último '(' del segmento: los datos nunca lo
+// contienen, así que cualquier basura previa queda descartada.
+std::string decodeFrame(const std::string &segment) {
+  size_t start = segment.rfind('(');
+  if (start == std::string::npos)
+    throw std::runtime_error("No se encontró '('");
+  size_t len = segment.size() - start;
+  if (len < 3)
+    throw std::runtime_error("Trama demasiado corta");
+  const uint8_t *frame =
+      reinterpret_cast<const uint8_t *>(segment.data() + start);
+  uint16_t expected = crc16Voltronic(frame, len - 2);
+  uint16_t received = (frame[len - 2] << 8) | frame[len - 1];
+  if (expected != received)
+    throw std::runtime_error("CRC inválido en trama");
+  return segment.substr(start + 1, len - 3);
+}
+
+ResponseMatcher::Match ResponseMatcher::match(const std::string &segment,
+                                              int unit, uint8_t &owner) {
+  if (segment.find('(') == std::string::npos)
+    return MATCH_NOISE;
+  if (pending_.empty()) {
+    owner = 0xff;
+    return MATCH_UNSOLICITED;
+  }
+  owner = pending_.front().unit;
+  pending_.pop_front();
+  if (owner != unit || !pending_.empty())
+    return MATCH_LATE;
+  return MATCH_CURRENT;
+}
+
+void ResponseMatcher::expire(int64_t now_ms, int64_t max_age_ms) {
+  while (pending_.size() > 1 && now_ms - pending_.front().sent_ms > max_age_ms)
+    pending_.pop_front();
+}
+
+// === Decodificación QPGS ===
+void addFaultFlags(json &j, const std::string &faultStr) {
+  j["01_fan_locked"] = 0;
+  j["02_over_temperature"] = 0;
+  j["03_battery_voltage_high"] = 0;
+  j["04_battery_voltage_low"] = 0;
+  j["05_output_short_circuited"] = 0;
+  j["06_output_voltage_high"] = 0;
+  j["07_overload_timeout"] = 0;
+  j["08_bus_voltage_high"] = 0;
+  j["09_bus_soft_start_failed"] = 0;
+  j["10_pv_over_current"] = 0;
+  j["11_pv_over_voltage"] = 0;
+  j["12_dcdc_over_current"] = 0;
+  j["13_battery_discharge_over_current"] = 0;
+  j["51_over_current"] = 0;
+  j["52_bus_voltage_low"] = 0;
+  j["53_inverter_soft_start_failed"] = 0;
+  j["55_over_dc_voltage_in_ac_output"] = 0;
+  j["57_current_sensor_failed"] = 0;
+  j["58_output_voltage_low"] = 0;
+  j["60_power_feedback_protection"] = 0;
+  j["71_firmware_version_inconsistent"] = 0;
+  j["72_current_sharing_fault"] = 0;
+  j["80_can_fault"] = 0;
+  j["81_host_loss"] = 0;
+  j["82_synchronization_loss"] = 0;
+  j["83_battery_voltage_diff_parallel"] = 0;
+  j["84_ac_input_diff_parallel"] = 0;
+  j["85_ac_output_unbalance"] = 0;
+  j["86_ac_output_mode_diff"] = 0;
+
+  if (faultStr == "00")
+    return;
+  int code = 0;
+  try {
+    code = std::stoi(faultStr);
+  } catch (...) {
+    return;
+  }
+
+  switch (code) {
+  case 1:
+    j["01_fan_locked"] = 1;
+    break;
+  case 2:
+    j["02_over_temperature"] = 1;
+    break;
+  case 3:
+    j["03_battery_voltage_high"] = 1;
+    break;
+  case 4:
+    j["04_battery_voltage_low"] = 1;
+    break;
+  case 5:
+    j["05_output_short_circuited"] = 1;
+    break;
+  case 6:
+    j["06_output_voltage_high"] = 1;
+    break;
+  case 7:
+    j["07_overload_timeout"] = 1;
+    break;
+  case 8:
+    j["08_bus_voltage_high"] = 1;
+    break;
+  case 9:
+    j["09_bus_soft_start_failed"] = 1;
+    break;
+  case 10:
+    j["10_pv_over_current"] = 1;
+    break;
+  case 11:
+    j["11_pv_over_voltage"] = 1;
+    break;
+  case 12:
+    j["12_dcdc_over_current"] = 1;
+    break;
+  case 13:
+    j["13_battery_discharge_over_current"] = 1;
+    break;
+  case 51:
+    j["51_over_current"] = 1;
+    break;
+  case 52:
+    j["52_bus_voltage_low"] = 1;
+    break;
+  case 53:
+    j["53_inverter_soft_start_failed"] = 1;
+    break;
+  case 55:
+    j["55_over_dc_voltage_in_ac_output"] = 1;
+    break;
+  case 57:
+    j["57_current_sensor_failed"] = 1;
+    break;
+  case 58:
+    j["58_output_voltage_low"] = 1;
+    break;
+  case 60:
+    j["60_power_feedback_protection"] = 1;
+    break;
+  case 71:
+    j["71_firmware_version_inconsistent"] = 1;
+    break;
+  case 72:
+    j["72_current_sharing_fault"] = 1;
+    break;
+  case 80:
+    j["80_can_fault"] = 1;
+    break;
+  case 81:
+    j["81_host_loss"] = 1;
+    break;
+  case 82:
+    j["82_synchronization_loss"] = 1;
+    break;
+  case 83:
+    j["83_battery_voltage_diff_parallel"] = 1;
+    break;
+  case 84:
+    j["84_ac_input_diff_parallel"] = 1;
+    break;
+  case 85:
+    j["85_ac_output_unbalance"] = 1;
+    break;
+  case 86:
+    j["86_ac_output_mode_diff"] = 1;
+    break;
+  default:
+    break;
+  }
+}
+
+void addInverterStatusFlags(json &j, const std::string &statusStr) {
+  j["alarm_scc_loss"] = 0;
+  j["status_ac_charging"] = 0;
+  j["status_solar_charging"] = 0;
+  j["alarm_battery_health"] = 0;
+  j["alarm_line_loss"] = 0;
+  j["status_load_on"] = 0;
+  j["status_configuration"] = 0;
+
+  if (statusStr.size() != 8)
+    return;
+  for (char c : statusStr)
+    if (c != '0' && c != '1')
+      return;
+
+  char b7 = statusStr[0];
+  char b6 = statusStr[1];
+  char b5 = statusStr[2];
+  char b4 = statusStr[3];
+  char b3 = statusStr[4];
+  char b2 = statusStr[5];
+  char b1 = statusStr[6];
+  char b0 = statusStr[7];
+
+  j["alarm_scc_loss"] = (b7 == '0') ? 1 : 0;
+  j["status_ac_charging"] = (b6 == '1') ? 1 : 0;
+  j["status_solar_charging"] = (b5 == '1') ? 1 : 0;
+  j["alarm_battery_health"] = (b4 == '0' && b3 == '0') ? 0 : 1;
+  j["alarm_line_loss"] = (b2 == '1') ? 1 : 0;
+  j["status_load_on"] = (b1 == '1') ? 1 : 0;
+  j["status_configuration"] = (b0 == '1') ? 1 : 0;
+}
+
+json parseQPGS(const std::string &cleanResponse, const std::string &inverterId,
+               std::string &out_fault_code, std::string &out_inverter_status) {
+  std::istringstream iss(cleanResponse);
+  std::vector<std::string> fields;
+  std::string field;
+  while (iss >> field) {
+    fields.push_back(field);
+  }
+  if (fields.size() < 28) {
+    throw std::runtime_error("Menos de 28 campos en QPGS");
+  }
+
+  out_fault_code = fields[3];
+  out_inverter_status = fields[19];
+
+  auto to_double = [](const std::string &s) -> double {
+    try {
+      return std::stod(s);
+    } catch (...) {
+      return 0.0;
+    }
+  };
+  auto to_int = [](const std::string &s) -> int {
+    try {
+      return std::stoi(s);
+    } catch (...) {
+      return 0;
+    }
+  };
+  auto round2 = [](double value) -> double {
+    return std::round(value * 100.0) / 100.0;
+  };
+
+  // --- PV cálculos (campos 14, 25, 27) ---
+  double pv1_v = round2(to_double(fields[14]));      // PV1 voltage
+  double pv2_v = round2(to_double(fields[27]));      // PV2 voltage
+  double pv_total_i = round2(to_double(fields[25])); // Total PV current
+  double pv1_i = 0.0, pv2_i = 0.0;
+
+  if (pv1_v + pv2_v > 0.1) {
+    pv1_i = pv_total_i * (pv1_v / (pv1_v + pv2_v));
+    pv2_i = pv_total_i * (pv2_v / (pv1_v + pv2_v));
+  } else {
+    pv1_i = pv_total_i;
+    pv2_i = 0.0;
+  }
+  pv1_i = round2(pv1_i);
+  pv2_i = round2(pv2_i);
+  double pv1_p = round2(pv1_v * pv1_i);
+  double pv2_p = round2(pv2_v * pv2_i);
+
+  json j;
+  j["inverter_id"] = inverterId;
+  j["parallel_configuration"] = fields[0];
+  j["serial_number"] = fields[1];
+  j["work_mode"] = fields[2];
+  j["grid_input_voltage"] = round2(to_double(fields[4]));
+  j["grid_input_frequency"] = round2(to_double(fields[5]));
+  j["ac_output_voltage"] = round2(to_double(fields[6]));
+  j["ac_output_frequency"] = round2(to_double(fields[7]));
+  j["ac_output_apparent_power"] = to_int(fields[8]);
+  j["ac_output_active_power"] = to_int(fields[9]);
+
+  double ac_apparent = static_cast<double>(to_int(fields[8]));
+  double ac_active = static_cast<double>(to_int(fields[9]));
+  double ac_reactive = std::round((ac_apparent - ac_active) * 100.0) / 100.0;
+  j["ac_output_reactive_power"] = ac_reactive;
+
+  j["load_percentage"] = to_int(fields[10]);
+  j["battery_voltage"] = round2(to_double(fields[11]));
+  j["battery_charging_current"] = to_int(fields[12]);
+  j["battery_soc"] = to_int(fields[13]);
+  j["pv1_input_voltaje"] = pv1_v;
+  // 🔸 IMPORTANTE: LEER field[15] aunque no lo guardemos
+  int battery_total_charging =
+      to_int(fields[15]); // <-- Necesario para no desplazar índices
+  // j["battery_total_all_inputs_charging_current"] = battery_total_charging; //
+  // NO se incluye
+
+  j["output_mode"] = to_int(fields[20]);
+  j["charger_source_priority"] = to_int(fields[21]);
+  j["config_max_charger_current"] = to_int(fields[22]);
+  j["config_max_charge_range"] = to_int(fields[23]);
+  j["config_max_ac_charger_current"] =
+      to_int(fields[24]); // ← usado en cálculo AC power
+
+  j["pv_total_input_current"] =
+      pv_total_i; // ← Este se mantiene (reemplaza "total_inv_pv_input_current")
+  j["battery_discharge_current"] = to_int(fields[26]);
+  j["pv2_input_voltaje"] = pv2_v;
+  j["pv1_input_current"] = pv1_i;
+  j["pv2_input_current"] = pv2_i;
+  j["pv1_input_power"] = pv1_p;
+  j["pv2_input_power"] = pv2_p;
+
+  // 🔸 CALCULO: battery_real_charge_current
+  int charging = j["battery_charging_current"].get<int>();
+  int discharging = j["battery_discharge_current"].get<int>();
+  double battery_real_charge = 0.0;
+  if (charging > 0 && discharging == 0) {
+    battery_real_charge = static_cast<double>(charging);
+  } else if (charging == 0 && discharging > 0) {
+    battery_real_charge = -static_cast<double>(discharging);
+  } else if (charging > 0 && discharging > 0) {
+    battery_real_charge = static_cast<double>(charging - discharging);
+  }
+  battery_real_charge = round2(battery_real_charge);
+  j["battery_real_charge_current"] = battery_real_charge;
+
+  // 🔸 CALCULO: battery_real_power = real_charge * battery_voltage
+  double battery_voltage = j["battery_voltage"].get<double>();
+  double battery_real_power = round2(battery_real_charge * battery_voltage);
+  j["battery_real_power"] = battery_real_power;
+
+  // 🔸 CALCULO: ac_input_power_estimate = grid_voltage *
+  // config_max_ac_charger_current
+  double grid_voltage = j["grid_input_voltage"].get<double>();
+  int max_ac_charger = j["config_max_ac_charger_current"].get<int>();
+  double ac_input_power_estimate =
+      round2(grid_voltage * static_cast<double>(max_ac_charger));
+  j["ac_input_power_estimate"] = ac_input_power_estimate;
+
+  addFaultFlags(j, out_fault_code);
+  addInverterStatusFlags(j, out_inverter_status);
+  return j;
+}
+
+bool hasAnyAlarm(const json &j) {
+  std::vector<std::string> alarmFields = {"alarm_scc_loss",
+                                          "01_fan_locked",
+                                          "02_over_temperature",
+                                          "03_battery_voltage_high",
+                                          "04_battery_voltage_low",
+                                          "05_output_short_circuited",
+                                          "06_output_voltage_high",
+                                          "07_overload_timeout",
+                                          "08_bus_voltage_high",
+                                          "09_bus_soft_start_failed",
+                                          "10_pv_over_current",
+                                          "11_pv_over_voltage",
+                                          "12_dcdc_over_current",
+                                          "13_battery_discharge_over_current",
+                                          "51_over_current",
+                                          "52_bus_voltage_low",
+                                          "53_inverter_soft_start_failed",
+                                          "55_over_dc_voltage_in_ac_output",
+                                          "57_current_sensor_failed",
+                                          "58_output_voltage_low",
+                                          "60_power_feedback_protection",
+                                          "71_firmware_version_inconsistent",
+                                          "72_current_sharing_fault",
+                                          "80_can_fault",
+                                          "81_host_loss",
+                                          "82_synchronization_loss",
+                                          "83_battery_voltage_diff_parallel",
+                                          "84_ac_input_diff_parallel",
+                                          "85_ac_output_unbalance",
+                                          "86_ac_output_mode_diff"};
+  for (const auto &field : alarmFields) {
+    if (j.contains(field) && j[field] == 1) {
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+// Decodificación del protocolo Voltronic/Axpert (QPGS) y formato de trazas.
+// No depende de sockets ni de MQTT: lo comparten el modo continuo y el replay.
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+// === Trazas de captura ===
+// Formato del fichero de traza (little-endian):
+//   cabecera: "AXTR" + u16 versión + u16 reservado
+//   registro: u64 timestamp_us | u8 tipo | u8 unidad | u16 longitud | bytes
+enum FrameType : uint8_t {
+  FRAME_TX = 0,         // Comando enviado al inversor
+  FRAME_RX = 1,         // Respuesta completa (sin el CR final)
+  FRAME_RX_TIMEOUT = 2, // Respuesta parcial antes del timeout
+  FRAME_RX_LATE = 3,    // Respuesta tardía o sin petición, descartada
+  FRAME_RX_NOISE = 4    // Bytes fuera de trama (ruido o desbordamiento)
+};
+
+const char TRACE_MAGIC[4] = {'A', 'X', 'T', 'R'};
+const uint16_t TRACE_VERSION = 1;
+const size_t TRACE_HEADER_SIZE = 8;
+const size_t TRACE_RECORD_HEADER_SIZE = 12;
+
+struct TraceRecord {
+  uint64_t timestamp_us = 0;
+  uint8_t type = FRAME_TX;
+  uint8_t unit = 0;
+  std::string data;
+};
+
+std::vector<uint8_t> encodeTraceHeader();
+std::vector<uint8_t> encodeTraceRecord(const TraceRecord &rec);
+std::vector<TraceRecord> loadTrace(const std::string &path);
+// Bytes aprovechables de una traza existente (cabecera y registros
+// completos), o 0 si no existe o su cabecera no es válida.
+uint64_t traceValidSize(const std::string &path);
+
+// === Tramas ===
+const size_t MAX_FRAME_SIZE = 1024;
+
+uint16_t crc16Voltronic(const uint8_t *data, size_t len);
+std::vector<uint8_t> buildCommand(const std::string &name);
+std::string decodeFrame(const std::string &segment);
+
+// Acumula bytes del socket y los corta en segmentos terminados en CR,
+// conservando lecturas parciales entre llamadas. Los bytes que descarta por
+// desbordamiento se guardan hasta que se recogen con takeDiscarded().
+class FrameDecoder {
+public:
+  void feed(const char *data, size_t len) {
+    buffer_.append(data, len);
+    if (buffer_.size() > MAX_FRAME_SIZE && buffer_.find('\r') == npos) {
+      // Sin CR a la vista: resincronizar en el último '(' si lo que queda
+      // cabe en una trama; si no, nada de lo acumulado es aprovechable
+      size_t start = buffer_.rfind('(');
+      if (start == npos || start == 0 ||
+          buffer_.size() - start > MAX_FRAME_SIZE)
+        start = buffer_.size();
+      discarded_.append(buffer_, 0, start);
+      buffer_.erase(0, start);
+    }
+  }
+
+  bool takeDiscarded(std::string &bytes) {
+    if (discarded_.empty())
+      return false;
+    bytes.swap(discarded_);
+    discarded_.clear();
+    return true;
+  }
+
+  bool next(std::string &segment) {
+    size_t end = buffer_.find('\r');
+    if (end == npos)
+      return false;
+    segment.assign(buffer_, 0, end);
+    buffer_.erase(0, end + 1);
+    return true;
+  }
+
+  const std::string &partial() const { return buffer_; }
+
+private:
+  static constexpr size_t npos = std::string::npos;
+  std::string buffer_;
+  std::string discarded_;
+};
+
+// Asigna cada respuesta a la petición pendiente más antigua: el conversor
+// responde en orden, así que una respuesta que llega después de su timeout
+// se reconoce como tardía en lugar de tomarse por la de la petición actual.
+class ResponseMatcher {
+public:
+  enum Match {
+    MATCH_NOISE,       // Segmento sin '(': ruido de línea
+    MATCH_UNSOLICITED, // Respuesta sin ninguna petición pendiente
+    MATCH_LATE,        // Respuesta de una petición anterior ya abandonada
+    MATCH_CURRENT      // Respuesta de la petición en curso
+  };
+
+  void sent(uint8_t unit, int64_t now_ms) { pending_.push_back({unit, now_ms}); }
+
+  // Clasifica un segmento recibido mientras se espera la respuesta de
+  // `unit` (-1 si no se espera ninguna). `owner` es la unidad asignada.
+  Match match(const std::string &segment, int unit, uint8_t &owner);
+
+  // Olvida peticiones abandonadas más antiguas que `max_age_ms`, dejando
+  // siempre la última.
+  void expire(int64_t now_ms, int64_t max_age_ms);
+
+  size_t pending() const { return pending_.size(); }
+
+private:
+  struct Pending {
+    uint8_t unit;
+    int64_t sent_ms;
+  };
+  std::deque<Pending> pending_;
+};
+
+// === Decodificación QPGS ===
+void addFaultFlags(json &j, const std::string &faultStr);
+void addInverterStatusFlags(json &j, const std::string &statusStr);
+json parseQPGS(const std::string &cleanResponse, const std::string &inverterId,
+               std::string &out_fault_code, std::string &out_inverter_status);
+bool hasAnyAlarm(const json &j);
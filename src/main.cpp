@@ -1,26 +1,37 @@
+#include "decode.h"
+#include "rollup.h"
+
 #include <algorithm>
 #include <arpa/inet.h>
+#include <array>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
 #include <cmath>
+#include <cstddef>
 #include <cstring>
+#include <ctime>
 #include <dirent.h>
+#include <fcntl.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <map>
 #include <mosquitto.h>
+#include <mutex>
 #include <nlohmann/json.hpp>
+#include <poll.h>
 #include <regex>
 #include <sstream>
 #include <string>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h> // Necesario para Alpine/musl
+#include <sys/un.h>
 #include <thread>
 #include <unistd.h>
 #include <vector>
 
-using json = nlohmann::json;
-
 // === Configuración ===
 struct AppConfig {
   int delay_between_inverters_ms = 1000;
@@ -31,12 +42,18 @@ struct AppConfig {
   std::string mqtt_password = "";
   std::string inverter1_tcp_ip = "10.0.0.235";
   int inverter1_tcp_port = 26;
+  std::string capture_file = "";
+  int capture_max_mb = 64;
+  int cycle_deadline_ms = 0; // 0: suma de los plazos de las etapas
+  bool rollup_enabled = true;
 };
 AppConfig g_config;
 
 const std::string LOG_DIR = "log";
+const std::string REPLAY_LOG_DIR = LOG_DIR + "/replay";
 const int MAX_LOG_FILES = 5;
 std::ofstream g_logFile;
+std::mutex g_logMutex;
 
 // === Logger ===
 void logMessage(const std::string &msg) {
@@ -52,6 +69,7 @@ void logMessage(const std::string &msg) {
   oss << '.' << std::setfill('0') << std::setw(3) << ms.count();
   oss << " | " << msg;
   std::string fullMsg = oss.str();
+  std::lock_guard<std::mutex> lock(g_logMutex);
   std::cout << fullMsg << std::endl;
   if (g_logFile.is_open()) {
     g_logFile << fullMsg << std::endl;
@@ -59,24 +77,26 @@ void logMessage(const std::string &msg) {
   }
 }
 
-void createLogDir() {
+void createLogDir(const std::string &logDir) {
   struct stat info;
-  if (stat(LOG_DIR.c_str(), &info) != 0) {
-    mkdir(LOG_DIR.c_str(), 0755);
-    logMessage("📁 Directorio de logs creado: " + LOG_DIR);
+  for (const std::string &path : {LOG_DIR, logDir}) {
+    if (stat(path.c_str(), &info) != 0) {
+      mkdir(path.c_str(), 0755);
+      logMessage("📁 Directorio de logs creado: " + path);
+    }
   }
 }
 
-void rotateLogs() {
+void rotateLogs(const std::string &logDir) {
   std::vector<std::string> logFiles;
-  DIR *dir = opendir(LOG_DIR.c_str());
+  DIR *dir = opendir(logDir.c_str());
   if (!dir)
     return;
   struct dirent *entry;
   std::regex logPattern("axpert_monitor_\\d{8}_\\d{6}\\.log");
   while ((entry = readdir(dir)) != nullptr) {
     if (std::regex_match(entry->d_name, logPattern)) {
-      logFiles.push_back(LOG_DIR + "/" + std::string(entry->d_name));
+      logFiles.push_back(logDir + "/" + std::string(entry->d_name));
     }
   }
   closedir(dir);
@@ -89,17 +109,17 @@ void rotateLogs() {
   }
 }
 
-void initLogger() {
-  createLogDir();
+void initLogger(const std::string &logDir) {
+  createLogDir(logDir);
   auto now = std::chrono::system_clock::now();
   auto time_t = std::chrono::system_clock::to_time_t(now);
   std::tm tm;
   localtime_r(&time_t, &tm);
   std::ostringstream oss;
-  oss << LOG_DIR << "/axpert_monitor_" << std::put_time(&tm, "%Y%m%d_%H%M%S")
+  oss << logDir << "/axpert_monitor_" << std::put_time(&tm, "%Y%m%d_%H%M%S")
       << ".log";
   std::string logFileName = oss.str();
-  rotateLogs();
+  rotateLogs(logDir);
   g_logFile.open(logFileName, std::ios::out);
   logMessage("Intialized logger: " + logFileName);
 }
@@ -150,6 +170,27 @@ AppConfig loadConfig() {
       config.mqtt_password = j["mqtt_password"].get<std::string>();
     }
 
+    if (j.contains("capture_file") && j["capture_file"].is_string()) {
+      config.capture_file = j["capture_file"].get<std::string>();
+    }
+    if (j.contains("capture_max_mb") &&
+        j["capture_max_mb"].is_number_integer()) {
+      config.capture_max_mb = j["capture_max_mb"].get<int>();
+      if (config.capture_max_mb < 1)
+        config.capture_max_mb = 1;
+    }
+
+    if (j.contains("cycle_deadline_ms") &&
+        j["cycle_deadline_ms"].is_number_integer()) {
+      config.cycle_deadline_ms = j["cycle_deadline_ms"].get<int>();
+      if (config.cycle_deadline_ms < 0)
+        config.cycle_deadline_ms = 0;
+    }
+
+    if (j.contains("rollup_enabled") && j["rollup_enabled"].is_boolean()) {
+      config.rollup_enabled = j["rollup_enabled"].get<bool>();
+    }
+
     logMessage("⚙️  Configuración cargada desde config/app_config.json");
   } catch (const std::exception &e) {
     logMessage("⚠️ Error al parsear config/app_config.json: " +
@@ -159,419 +200,928 @@ AppConfig loadConfig() {
 }
 
 // === MQTT ===
-const char *TOPIC_INV0 = "homeassistant/axpert/inv01";
-const char *TOPIC_INV1 = "homeassistant/axpert/inv02";
-const char *TOPIC_TOTALS = "homeassistant/axpert/totales";
+const std::string TOPIC_BASE = "homeassistant/axpert/";
+const std::string TOPIC_REPLAY_BASE = TOPIC_BASE + "replay/";
+const char *TOPIC_INV0 = "inv01";
+const char *TOPIC_INV1 = "inv02";
+const char *TOPIC_TOTALS = "totales";
+const char *TOPIC_MONITOR = "monitor";
+const char *TOPIC_ROLLUP = "rollup/";
+
+// En replay se publica bajo TOPIC_REPLAY_BASE: los sensores de Home Assistant
+// escuchan en TOPIC_BASE y registrarían los datos antiguos con la hora actual
+std::string g_topicBase = TOPIC_BASE;
+
+std::string topicFor(const std::string &name) { return g_topicBase + name; }
+
+// En replay se desactiva para no pisar el estado actual con datos antiguos
+bool g_publishRetained = true;
+// Replay sin broker: se serializa igual pero no se envía ni se registra
+bool g_publishNullSink = false;
+uint64_t g_nullSinkBytes = 0;
+
+// Por debajo del plazo de la etapa connect, para que expire antes nuestro
+// propio timeout que el del supervisor.
+const int MQTT_CONNECT_TIMEOUT_MS = 8000;
+
+// CONNACK del broker: -1 mientras no llega, 0 si acepta la sesión.
+int g_connack = -1;
+
+void onConnect(struct mosquitto *, void *, int rc) { g_connack = rc; }
+
+// Conecta sin bloquear y espera el CONNACK: mosquitto_connect da por buena la
+// conexión en cuanto abre el TCP, aunque el broker rechace las credenciales.
+void connectMQTT(struct mosquitto *mosq, int timeout_ms) {
+  g_connack = -1;
+  int rc = mosquitto_connect_async(mosq, g_config.mqtt_broker_ip.c_str(),
+                                   g_config.mqtt_broker_port, 60);
+  if (rc != MOSQ_ERR_SUCCESS)
+    throw std::runtime_error(mosquitto_strerror(rc));
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(timeout_ms);
+  while (g_connack < 0) {
+    int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        deadline - std::chrono::steady_clock::now())
+                        .count();
+    if (remaining <= 0) {
+      mosquitto_disconnect(mosq);
+      throw std::runtime_error("Sin CONNACK en " + std::to_string(timeout_ms) +
+                               " ms");
+    }
+    rc = mosquitto_loop(mosq, std::min(remaining, 100), 1);
+    if (rc != MOSQ_ERR_SUCCESS && g_connack < 0)
+      throw std::runtime_error(mosquitto_strerror(rc));
+  }
+  if (g_connack != 0)
+    throw std::runtime_error(mosquitto_connack_string(g_connack));
+}
 
-void publishMQTT(struct mosquitto *mosq, const char *topic, const json &data) {
+// Devuelve false si el mensaje no se pudo entregar al cliente MQTT.
+bool publishMQTT(struct mosquitto *mosq, const std::string &topic,
+                 const json &data, bool retain = true) {
   std::string payload = data.dump();
-  int ret = mosquitto_publish(mosq, nullptr, topic, payload.length(),
-                              payload.c_str(), 0, true);
+  if (g_publishNullSink) {
+    g_nullSinkBytes += payload.size();
+    return true;
+  }
+  retain = retain && g_publishRetained;
+  int ret = mosquitto_publish(mosq, nullptr, topic.c_str(), payload.length(),
+                              payload.c_str(), 0, retain);
   if (ret != MOSQ_ERR_SUCCESS) {
-    logMessage("❌ Fallo al publicar en MQTT: " + std::string(topic));
+    logMessage("❌ Fallo al publicar en MQTT: " + topic + " (" +
+               mosquitto_strerror(ret) + ")");
+    return false;
+  }
+  if (retain) {
+    logMessage("✅ Publicado (retain) en: " + topic);
   } else {
-    logMessage("✅ Publicado (retain) en: " + std::string(topic));
+    logMessage("✅ Publicado en: " + topic);
   }
+  return true;
 }
 
+// === Captura y reproducción de tramas ===
+uint64_t nowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+// Escritor de trazas: cada registro reserva su hueco con un fetch_add
+// atómico y se escribe con un único pwrite, sin mutex.
+class FrameRecorder {
+public:
+  ~FrameRecorder() { close(); }
+
+  // path_ solo se fija si la apertura sale bien, para reintentar en el
+  // siguiente ciclo. Una traza existente se continúa tras su último registro
+  // completo; si su cabecera no es válida se empieza de cero.
+  void configure(const std::string &path, uint64_t maxBytes) {
+    max_bytes_.store(maxBytes);
+    if (path == path_)
+      return;
+    close();
+    if (path.empty())
+      return;
+
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+      logMessage("❌ No se pudo abrir el fichero de captura: " + path);
+      return;
+    }
+    struct stat st;
+    uint64_t size = (fstat(fd, &st) == 0) ? st.st_size : 0;
+    uint64_t valid = traceValidSize(path);
+    if (valid == 0) {
+      if (size > 0)
+        logMessage("⚠️ Cabecera de captura no válida, se reinicia: " + path);
+      std::vector<uint8_t> header = encodeTraceHeader();
+      if (ftruncate(fd, 0) != 0 ||
+          pwrite(fd, header.data(), header.size(), 0) !=
+              static_cast<ssize_t>(header.size())) {
+        logMessage("❌ No se pudo escribir la cabecera de captura: " + path);
+        ::close(fd);
+        return;
+      }
+      valid = TRACE_HEADER_SIZE;
+    } else if (valid < size) {
+      logMessage("⚠️ Registro incompleto al final de la captura, se recorta: " +
+                 path);
+      if (ftruncate(fd, valid) != 0) {
+        logMessage("❌ No se pudo recortar el fichero de captura: " + path);
+        ::close(fd);
+        return;
+      }
+    }
+    path_ = path;
+    offset_.store(valid);
+    limit_logged_.store(false);
+    fd_.store(fd);
+    logMessage("🎙️  Captura de tramas activa en: " + path_);
+  }
+
+  void record(FrameType type, uint8_t unit, const void *data, size_t len) {
+    int fd = fd_.load();
+    if (fd < 0)
+      return;
+
+    TraceRecord rec;
+    rec.timestamp_us = nowMicros();
+    rec.type = type;
+    rec.unit = unit;
+    rec.data.assign(static_cast<const char *>(data), len);
+    std::vector<uint8_t> buf = encodeTraceRecord(rec);
+
+    uint64_t at = offset_.fetch_add(buf.size());
+    if (at + buf.size() > max_bytes_.load()) {
+      if (!limit_logged_.exchange(true)) {
+        logMessage("⚠️ Límite de captura alcanzado, se descartan tramas: " +
+                   path_);
+      }
+      return;
+    }
+    if (pwrite(fd, buf.data(), buf.size(), at) < 0) {
+      logMessage("❌ Error al escribir trama en captura");
+    }
+  }
+
+private:
+  void close() {
+    int fd = fd_.exchange(-1);
+    if (fd >= 0)
+      ::close(fd);
+    path_.clear();
+  }
+
+  std::string path_;
+  std::atomic<int> fd_{-1};
+  std::atomic<uint64_t> offset_{0};
+  std::atomic<uint64_t> max_bytes_{0};
+  std::atomic<bool> limit_logged_{false};
+};
+FrameRecorder g_recorder;
+
 // === Comunicación con inversores ===
-void flushSocket(int sockfd) {
-  char dummy[256];
-  struct timeval timeout;
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 50000;
-  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-  while (recv(sockfd, dummy, sizeof(dummy), MSG_DONTWAIT) > 0) {
-  }
-  timeout.tv_sec = 5;
-  timeout.tv_usec = 0;
-  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+const int RESPONSE_TIMEOUT_MS = 5000;
+
+int64_t steadyMillis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
 }
 
-std::string
-sendCommandAndGetCleanResponse(int sockfd,
-                               const std::vector<uint8_t> &command) {
-  flushSocket(sockfd);
-  if (send(sockfd, command.data(), command.size(), 0) < 0) {
-    throw std::runtime_error("Error al enviar comando");
-  }
-  std::string raw;
-  char buffer[1];
-  ssize_t bytes;
-  while ((bytes = recv(sockfd, buffer, 1, 0)) > 0) {
-    if (buffer[0] == 0x0D)
-      break;
-    raw += buffer[0];
-  }
-  if (bytes <= 0)
-    throw std::runtime_error("Timeout en recepción");
-  size_t start = raw.find('(');
-  if (start == std::string::npos)
-    throw std::runtime_error("No se encontró '('");
-  return raw.substr(start + 1);
+// connect() no bloqueante con plazo propio, por debajo del de la etapa
+// connect: el supervisor queda solo como respaldo.
+const int TCP_CONNECT_TIMEOUT_MS = 8000;
+
+bool connectWithTimeout(int sockfd, const struct sockaddr_in &addr,
+                        int timeout_ms) {
+  int flags = fcntl(sockfd, F_GETFL, 0);
+  if (flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0)
+    return false;
+  int rc = connect(sockfd, (const struct sockaddr *)&addr, sizeof(addr));
+  if (rc < 0 && errno == EINPROGRESS) {
+    struct pollfd pfd = {sockfd, POLLOUT, 0};
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (poll(&pfd, 1, timeout_ms) == 1 &&
+        getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0)
+      rc = 0;
+  }
+  fcntl(sockfd, F_SETFL, flags);
+  return rc == 0;
 }
 
-// === Decodificación ===
-void addFaultFlags(json &j, const std::string &faultStr) {
-  j["01_fan_locked"] = 0;
-  j["02_over_temperature"] = 0;
-  j["03_battery_voltage_high"] = 0;
-  j["04_battery_voltage_low"] = 0;
-  j["05_output_short_circuited"] = 0;
-  j["06_output_voltage_high"] = 0;
-  j["07_overload_timeout"] = 0;
-  j["08_bus_voltage_high"] = 0;
-  j["09_bus_soft_start_failed"] = 0;
-  j["10_pv_over_current"] = 0;
-  j["11_pv_over_voltage"] = 0;
-  j["12_dcdc_over_current"] = 0;
-  j["13_battery_discharge_over_current"] = 0;
-  j["51_over_current"] = 0;
-  j["52_bus_voltage_low"] = 0;
-  j["53_inverter_soft_start_failed"] = 0;
-  j["55_over_dc_voltage_in_ac_output"] = 0;
-  j["57_current_sensor_failed"] = 0;
-  j["58_output_voltage_low"] = 0;
-  j["60_power_feedback_protection"] = 0;
-  j["71_firmware_version_inconsistent"] = 0;
-  j["72_current_sharing_fault"] = 0;
-  j["80_can_fault"] = 0;
-  j["81_host_loss"] = 0;
-  j["82_synchronization_loss"] = 0;
-  j["83_battery_voltage_diff_parallel"] = 0;
-  j["84_ac_input_diff_parallel"] = 0;
-  j["85_ac_output_unbalance"] = 0;
-  j["86_ac_output_mode_diff"] = 0;
-
-  if (faultStr == "00")
-    return;
-  int code = 0;
-  try {
-    code = std::stoi(faultStr);
-  } catch (...) {
-    return;
+// Enlace con el conversor TCP/serie. Se mantiene durante todo el ciclo para
+// que ResponseMatcher reconozca la respuesta tardía de una petición anterior.
+class InverterLink {
+public:
+  explicit InverterLink(int sockfd) : sockfd_(sockfd) {}
+
+  std::string transact(const std::vector<uint8_t> &command, uint8_t unit) {
+    drainAvailable();
+    g_recorder.record(FRAME_TX, unit, command.data(), command.size());
+    if (send(sockfd_, command.data(), command.size(), MSG_NOSIGNAL) < 0) {
+      throw std::runtime_error("Error al enviar comando");
+    }
+    auto sent = std::chrono::steady_clock::now();
+    matcher_.sent(unit, steadyMillis());
+
+    auto deadline = sent + std::chrono::milliseconds(RESPONSE_TIMEOUT_MS);
+    std::string payload;
+    while (!takeResponse(unit, payload)) {
+      int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          deadline - std::chrono::steady_clock::now())
+                          .count();
+      if (remaining <= 0 || !readChunk(remaining)) {
+        recordDiscarded(unit);
+        const std::string &partial = decoder_.partial();
+        g_recorder.record(FRAME_RX_TIMEOUT, unit, partial.data(),
+                          partial.size());
+        throw std::runtime_error("Timeout en recepción");
+      }
+    }
+    return payload;
   }
 
-  switch (code) {
-  case 1:
-    j["01_fan_locked"] = 1;
-    break;
-  case 2:
-    j["02_over_temperature"] = 1;
-    break;
-  case 3:
-    j["03_battery_voltage_high"] = 1;
-    break;
-  case 4:
-    j["04_battery_voltage_low"] = 1;
-    break;
-  case 5:
-    j["05_output_short_circuited"] = 1;
-    break;
-  case 6:
-    j["06_output_voltage_high"] = 1;
-    break;
-  case 7:
-    j["07_overload_timeout"] = 1;
-    break;
-  case 8:
-    j["08_bus_voltage_high"] = 1;
-    break;
-  case 9:
-    j["09_bus_soft_start_failed"] = 1;
-    break;
-  case 10:
-    j["10_pv_over_current"] = 1;
-    break;
-  case 11:
-    j["11_pv_over_voltage"] = 1;
-    break;
-  case 12:
-    j["12_dcdc_over_current"] = 1;
-    break;
-  case 13:
-    j["13_battery_discharge_over_current"] = 1;
-    break;
-  case 51:
-    j["51_over_current"] = 1;
-    break;
-  case 52:
-    j["52_bus_voltage_low"] = 1;
-    break;
-  case 53:
-    j["53_inverter_soft_start_failed"] = 1;
-    break;
-  case 55:
-    j["55_over_dc_voltage_in_ac_output"] = 1;
-    break;
-  case 57:
-    j["57_current_sensor_failed"] = 1;
-    break;
-  case 58:
-    j["58_output_voltage_low"] = 1;
-    break;
-  case 60:
-    j["60_power_feedback_protection"] = 1;
-    break;
-  case 71:
-    j["71_firmware_version_inconsistent"] = 1;
-    break;
-  case 72:
-    j["72_current_sharing_fault"] = 1;
-    break;
-  case 80:
-    j["80_can_fault"] = 1;
-    break;
-  case 81:
-    j["81_host_loss"] = 1;
-    break;
-  case 82:
-    j["82_synchronization_loss"] = 1;
-    break;
-  case 83:
-    j["83_battery_voltage_diff_parallel"] = 1;
-    break;
-  case 84:
-    j["84_ac_input_diff_parallel"] = 1;
-    break;
-  case 85:
-    j["85_ac_output_unbalance"] = 1;
-    break;
-  case 86:
-    j["86_ac_output_mode_diff"] = 1;
-    break;
-  default:
-    break;
+private:
+  bool readChunk(int timeout_ms) {
+    struct pollfd pfd = {sockfd_, POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+      return false;
+    char buffer[256];
+    ssize_t bytes = recv(sockfd_, buffer, sizeof(buffer), 0);
+    if (bytes <= 0)
+      return false;
+    decoder_.feed(buffer, bytes);
+    return true;
   }
+
+  // Consume lo que ya esté en el socket (respuestas tardías o basura) sin
+  // esperar, antes de enviar un nuevo comando.
+  void drainAvailable() {
+    while (readChunk(0)) {
+    }
+    std::string unused;
+    takeResponse(-1, unused);
+  }
+
+  // Graba los bytes que el decodificador tiró por desbordamiento.
+  void recordDiscarded(int unit) {
+    std::string bytes;
+    if (decoder_.takeDiscarded(bytes))
+      g_recorder.record(FRAME_RX_NOISE, unit < 0 ? 0xff : unit, bytes.data(),
+                        bytes.size());
+  }
+
+  // Procesa los segmentos completos. Devuelve true cuando llega la respuesta
+  // de `unit`; lanza excepción si esa respuesta llega corrupta.
+  bool takeResponse(int unit, std::string &payload) {
+    matcher_.expire(steadyMillis(), 2 * RESPONSE_TIMEOUT_MS);
+    recordDiscarded(unit);
+    std::string segment;
+    while (decoder_.next(segment)) {
+      uint8_t owner = 0;
+      switch (matcher_.match(segment, unit, owner)) {
+      case ResponseMatcher::MATCH_NOISE:
+        g_recorder.record(FRAME_RX_NOISE, unit < 0 ? 0xff : unit,
+                          segment.data(), segment.size());
+        continue;
+      case ResponseMatcher::MATCH_UNSOLICITED:
+        g_recorder.record(FRAME_RX_LATE, owner, segment.data(),
+                          segment.size());
+        logMessage("⚠️ Trama sin petición descartada");
+        continue;
+      case ResponseMatcher::MATCH_LATE:
+        g_recorder.record(FRAME_RX_LATE, owner, segment.data(),
+                          segment.size());
+        logMessage("⚠️ Respuesta tardía de QPGS" + std::to_string(owner) +
+                   " descartada");
+        continue;
+      case ResponseMatcher::MATCH_CURRENT:
+        g_recorder.record(FRAME_RX, owner, segment.data(), segment.size());
+        payload = decodeFrame(segment);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  int sockfd_;
+  FrameDecoder decoder_;
+  ResponseMatcher matcher_;
+};
+
+// === Supervisor (watchdog) ===
+// Cada etapa del ciclo tiene un plazo. Un hilo supervisor aborta el enlace
+// que se pase de plazo (shutdown del socket). La salud depende de la edad de
+// la última publicación correcta: si supera el límite, el latido lo refleja
+// y deja de enviarse WATCHDOG=1, falle el ciclo rápido o se cuelgue.
+enum Stage : int {
+  STAGE_CONNECT = 0,
+  STAGE_REQUEST,
+  STAGE_PARSE,
+  STAGE_PUBLISH,
+  STAGE_COUNT,
+  STAGE_IDLE = STAGE_COUNT
+};
+
+const char *STAGE_NAMES[STAGE_COUNT] = {"connect", "request", "parse",
+                                        "publish"};
+const int STAGE_DEADLINE_MS[STAGE_COUNT] = {10000, RESPONSE_TIMEOUT_MS + 2000,
+                                            1000, 5000};
+const int SUPERVISOR_TICK_MS = 250;
+const int HEARTBEAT_INTERVAL_MS = 5000;
+const int HEARTBEAT_STALE_S = 15;
+const int MISSED_CYCLES_ALLOWED = 3;
+const std::string HEARTBEAT_FILE = LOG_DIR + "/heartbeat";
+const std::string STATUS_FILE = LOG_DIR + "/status.json";
+
+// Plazo del ciclo: nunca menor que lo que pueden sumar sus etapas (conexión
+// MQTT y TCP, dos peticiones, pausa entre inversores, parseo y publicación).
+int cycleDeadlineMs(const AppConfig &config) {
+  int stages = 2 * STAGE_DEADLINE_MS[STAGE_CONNECT] +
+               2 * STAGE_DEADLINE_MS[STAGE_REQUEST] +
+               STAGE_DEADLINE_MS[STAGE_PARSE] +
+               STAGE_DEADLINE_MS[STAGE_PUBLISH] +
+               config.delay_between_inverters_ms;
+  return std::max(config.cycle_deadline_ms, stages);
 }
 
-void addInverterStatusFlags(json &j, const std::string &statusStr) {
-  j["alarm_scc_loss"] = 0;
-  j["status_ac_charging"] = 0;
-  j["status_solar_charging"] = 0;
-  j["alarm_battery_health"] = 0;
-  j["alarm_line_loss"] = 0;
-  j["status_load_on"] = 0;
-  j["status_configuration"] = 0;
+// Edad máxima de la última publicación correcta para considerarse sano.
+int maxOkAgeMs(const AppConfig &config) {
+  return cycleDeadlineMs(config) +
+         MISSED_CYCLES_ALLOWED * config.delay_between_cycles_ms;
+}
 
-  if (statusStr.size() != 8)
+// Notificación a systemd sin depender de libsystemd.
+void sdNotify(const char *state) {
+  const char *path = getenv("NOTIFY_SOCKET");
+  if (!path || !*path)
+    return;
+  struct sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  size_t len = strnlen(path, sizeof(addr.sun_path) - 1);
+  std::memcpy(addr.sun_path, path, len);
+  if (addr.sun_path[0] == '@')
+    addr.sun_path[0] = '\0'; // Socket abstracto
+  int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
     return;
-  for (char c : statusStr)
-    if (c != '0' && c != '1')
+  sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr,
+         offsetof(struct sockaddr_un, sun_path) + len);
+  close(fd);
+}
+
+// Escritura atómica (fichero temporal + rename) para que los lectores
+// externos nunca vean un fichero a medias.
+void writeFileAtomic(const std::string &path, const std::string &content) {
+  std::string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::out | std::ios::trunc);
+    if (!out.is_open())
+      return;
+    out << content;
+  }
+  std::rename(tmp.c_str(), path.c_str());
+}
+
+// Estadística sobre las últimas N muestras, actualizada en O(1).
+class RollingStats {
+public:
+  void add(double value) {
+    if (count_ == N)
+      sum_ -= samples_[next_];
+    else
+      ++count_;
+    samples_[next_] = value;
+    sum_ += value;
+    next_ = (next_ + 1) % N;
+    last_ = value;
+  }
+
+  json toJson() const {
+    json j;
+    j["samples"] = count_;
+    if (count_ == 0)
+      return j;
+    double mn = samples_[0], mx = samples_[0];
+    for (size_t i = 1; i < count_; ++i) {
+      mn = std::min(mn, samples_[i]);
+      mx = std::max(mx, samples_[i]);
+    }
+    auto round2 = [](double v) { return std::round(v * 100.0) / 100.0; };
+    j["last_ms"] = round2(last_);
+    j["mean_ms"] = round2(sum_ / count_);
+    j["min_ms"] = round2(mn);
+    j["max_ms"] = round2(mx);
+    return j;
+  }
+
+private:
+  static constexpr size_t N = 60;
+  std::array<double, N> samples_{};
+  size_t count_ = 0;
+  size_t next_ = 0;
+  double sum_ = 0.0;
+  double last_ = 0.0;
+};
+
+class Watchdog {
+public:
+  ~Watchdog() { stop(); }
+
+  void start(int cycleDeadlineMs, int maxOkAgeMs) {
+    cycle_deadline_ms_.store(cycleDeadlineMs);
+    max_ok_age_ms_.store(maxOkAgeMs);
+    if (running_.exchange(true))
+      return;
+    // Margen de arranque: se cuenta como si el inicio fuera un ciclo correcto
+    last_ok_ms_.store(steadyMillis());
+    last_ok_epoch_.store(std::time(nullptr));
+    thread_ = std::thread(&Watchdog::run, this);
+    sdNotify("READY=1");
+  }
+
+  void stop() {
+    if (!running_.exchange(false))
+      return;
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+  void beginCycle() {
+    cycle_started_ = std::chrono::steady_clock::now();
+    cycle_start_ms_.store(steadyMillis());
+  }
+
+  void endCycle(bool ok) {
+    clearStage();
+    cycle_start_ms_.store(0);
+    cycle_stats_.add(std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - cycle_started_)
+                         .count());
+    ++cycles_;
+    if (ok) {
+      last_ok_ = std::chrono::system_clock::to_time_t(
+          std::chrono::system_clock::now());
+      last_ok_ms_.store(steadyMillis());
+      last_ok_epoch_.store(last_ok_);
+    } else {
+      ++failed_cycles_;
+    }
+    writeFileAtomic(STATUS_FILE, status().dump());
+  }
+
+  // Marca el inicio de una etapa. `fd` es lo que el supervisor cierra si la
+  // etapa se pasa de plazo; el hilo principal lo resuelve antes (p. ej. con
+  // mosquitto_socket) para que el supervisor no toque el cliente MQTT.
+  void beginStage(Stage stage, int fd = -1) {
+    stage_fd_.store(fd);
+    overrun_.store(false);
+    aborted_.store(false);
+    stage_started_ = std::chrono::steady_clock::now();
+    stage_start_ms_.store(steadyMillis());
+    stage_.store(stage);
+  }
+
+  void endStage() {
+    int stage = stage_.load();
+    if (stage == STAGE_IDLE)
       return;
+    stage_stats_[stage].add(std::chrono::duration<double, std::milli>(
+                                std::chrono::steady_clock::now() -
+                                stage_started_)
+                                .count());
+    clearStage();
+  }
 
-  char b7 = statusStr[0];
-  char b6 = statusStr[1];
-  char b5 = statusStr[2];
-  char b4 = statusStr[3];
-  char b3 = statusStr[4];
-  char b2 = statusStr[5];
-  char b1 = statusStr[6];
-  char b0 = statusStr[7];
-
-  j["alarm_scc_loss"] = (b7 == '0') ? 1 : 0;
-  j["status_ac_charging"] = (b6 == '1') ? 1 : 0;
-  j["status_solar_charging"] = (b5 == '1') ? 1 : 0;
-  j["alarm_battery_health"] = (b4 == '0' && b3 == '0') ? 0 : 1;
-  j["alarm_line_loss"] = (b2 == '1') ? 1 : 0;
-  j["status_load_on"] = (b1 == '1') ? 1 : 0;
-  j["status_configuration"] = (b0 == '1') ? 1 : 0;
+  json status() const {
+    json j;
+    j["cycles"] = cycles_;
+    j["failed_cycles"] = failed_cycles_;
+    j["cycle_overruns"] = cycle_overruns_.load();
+    j["last_cycle_ok"] = last_ok_;
+    j["cycle"] = cycle_stats_.toJson();
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+      json stage = stage_stats_[s].toJson();
+      stage["deadline_ms"] = STAGE_DEADLINE_MS[s];
+      stage["overruns"] = stage_overruns_[s].load();
+      j["stages"][STAGE_NAMES[s]] = stage;
+    }
+    return j;
+  }
+
+private:
+  void clearStage() {
+    stage_.store(STAGE_IDLE);
+    stage_fd_.store(-1);
+  }
+
+  void run() {
+    int64_t last_heartbeat = 0;
+    bool stall_logged = false;
+    bool stale_logged = false;
+    while (running_.load()) {
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(SUPERVISOR_TICK_MS));
+      int64_t now = steadyMillis();
+
+      // El exceso se cuenta una vez; el shutdown se reintenta en cada tick
+      // hasta que haya un socket válido que cerrar
+      int stage = stage_.load();
+      if (stage != STAGE_IDLE && !aborted_.load() &&
+          now - stage_start_ms_.load() > STAGE_DEADLINE_MS[stage]) {
+        if (!overrun_.exchange(true)) {
+          ++stage_overruns_[stage];
+          logMessage("⏱️ Etapa '" + std::string(STAGE_NAMES[stage]) +
+                     "' superó " + std::to_string(STAGE_DEADLINE_MS[stage]) +
+                     " ms");
+        }
+        int fd = stage_fd_.load();
+        if (fd >= 0 && shutdown(fd, SHUT_RDWR) == 0) {
+          aborted_.store(true);
+          logMessage("⏱️ Enlace de la etapa '" +
+                     std::string(STAGE_NAMES[stage]) + "' abortado");
+        }
+      }
+
+      int64_t cycle_start = cycle_start_ms_.load();
+      if (cycle_start != 0 &&
+          now - cycle_start > cycle_deadline_ms_.load()) {
+        if (!stall_logged) {
+          ++cycle_overruns_;
+          logMessage("🚨 Ciclo bloqueado más de " +
+                     std::to_string(cycle_deadline_ms_.load()) + " ms");
+          stall_logged = true;
+        }
+      } else {
+        stall_logged = false;
+      }
+
+      bool healthy = now - last_ok_ms_.load() <= max_ok_age_ms_.load();
+      if (!healthy && !stale_logged) {
+        logMessage("🚨 Sin publicación correcta en " +
+                   std::to_string(max_ok_age_ms_.load()) +
+                   " ms, latido en fallo");
+      }
+      stale_logged = !healthy;
+
+      if (now - last_heartbeat >= HEARTBEAT_INTERVAL_MS) {
+        // El latido se escribe siempre (el proceso sigue vivo) con la edad
+        // permitida, para que --healthcheck aplique el mismo criterio
+        json beat;
+        beat["beat"] = std::time(nullptr);
+        beat["last_ok"] = last_ok_epoch_.load();
+        beat["max_age_s"] = (max_ok_age_ms_.load() + 999) / 1000;
+        writeFileAtomic(HEARTBEAT_FILE, beat.dump());
+        if (healthy)
+          sdNotify("WATCHDOG=1");
+        last_heartbeat = now;
+      }
+    }
+  }
+
+  std::thread thread_;
+  std::atomic<bool> running_{false};
+  std::atomic<int> cycle_deadline_ms_{0};
+  std::atomic<int> max_ok_age_ms_{0};
+  std::atomic<int64_t> last_ok_ms_{0};
+  std::atomic<std::time_t> last_ok_epoch_{0};
+  std::atomic<int64_t> cycle_start_ms_{0};
+  std::atomic<int> stage_{STAGE_IDLE};
+  std::atomic<int64_t> stage_start_ms_{0};
+  std::atomic<int> stage_fd_{-1};
+  std::atomic<bool> overrun_{false};
+  std::atomic<bool> aborted_{false};
+  std::atomic<uint64_t> stage_overruns_[STAGE_COUNT] = {};
+  std::atomic<uint64_t> cycle_overruns_{0};
+
+  // Solo se usan desde el hilo principal
+  std::chrono::steady_clock::time_point cycle_started_;
+  std::chrono::steady_clock::time_point stage_started_;
+  RollingStats cycle_stats_;
+  RollingStats stage_stats_[STAGE_COUNT];
+  uint64_t cycles_ = 0;
+  uint64_t failed_cycles_ = 0;
+  std::time_t last_ok_ = 0;
+};
+Watchdog g_watchdog;
+
+// Comprobación para HEALTHCHECK de Docker: sano si el latido es reciente y
+// la última publicación correcta no supera la edad máxima.
+int runHealthcheck() {
+  std::ifstream in(HEARTBEAT_FILE);
+  json beat = json::parse(in, nullptr, false);
+  if (beat.is_discarded() || !beat.is_object())
+    return 1;
+  for (const char *key : {"beat", "last_ok", "max_age_s"}) {
+    if (!beat.contains(key) || !beat[key].is_number_integer())
+      return 1;
+  }
+  long long now = std::time(nullptr);
+  if (now - beat["beat"].get<long long>() > HEARTBEAT_STALE_S)
+    return 1;
+  return (now - beat["last_ok"].get<long long>() <=
+          beat["max_age_s"].get<long long>())
+             ? 0
+             : 1;
 }
 
-json parseQPGS(const std::string &cleanResponse, const std::string &inverterId,
-               std::string &out_fault_code, std::string &out_inverter_status) {
-  std::istringstream iss(cleanResponse);
-  std::vector<std::string> fields;
-  std::string field;
-  while (iss >> field) {
-    fields.push_back(field);
+// === Rollups (agregados para almacenamiento a largo plazo) ===
+std::map<std::string, RollupSeries> g_rollups;
+
+// Publica en <prefijo>/<1m|15m>/<serie> cada ventana que se cierre.
+// Sin retain: son un flujo histórico para el consumidor central, no estado.
+void addRollupSample(struct mosquitto *mosq, const std::string &series,
+                     const std::vector<RollupField> &schema,
+                     const json &sample, std::time_t t) {
+  std::vector<std::pair<int, json>> closed;
+  g_rollups.try_emplace(series, schema).first->second.add(sample, t, closed);
+  for (const auto &window : closed) {
+    std::string topic = topicFor(TOPIC_ROLLUP) +
+                        std::to_string(window.first / 60) + "m/" + series;
+    publishMQTT(mosq, topic, window.second, false);
   }
-  if (fields.size() < 28) {
-    throw std::runtime_error("Menos de 28 campos en QPGS");
+}
+
+// === Agregación y publicación ===
+// Devuelve true solo si se publicaron las tres muestras (inv01, inv02 y
+// totales); los rollups no cuentan para la salud del ciclo.
+bool processResponses(struct mosquitto *mosq, const std::string &resp0,
+                      const std::string &resp1, std::time_t sampleTime) {
+  g_watchdog.beginStage(STAGE_PARSE);
+  std::string fault0, status0, fault1, status1;
+  json inv0 = parseQPGS(resp0, "QPGS0", fault0, status0);
+  json inv1 = parseQPGS(resp1, "QPGS1", fault1, status1);
+
+  // 🔍 [OPCIONAL] Logs de depuración (puedes comentarlos si no los
+  // necesitas)
+  logMessage(
+      "DEBUG inv0 battery_real_charge_current: " +
+      std::to_string(inv0["battery_real_charge_current"].get<double>()));
+  logMessage("DEBUG inv0 ac_input_power_estimate: " +
+             std::to_string(inv0["ac_input_power_estimate"].get<double>()));
+  logMessage(
+      "DEBUG inv1 battery_real_charge_current: " +
+      std::to_string(inv1["battery_real_charge_current"].get<double>()));
+
+  // === CÁLCULOS ===
+  double total_system_battery_real_charge =
+      inv0["battery_real_charge_current"].get<double>() +
+      inv1["battery_real_charge_current"].get<double>();
+  total_system_battery_real_charge =
+      std::round(total_system_battery_real_charge * 100.0) / 100.0;
+
+  double total_system_battery_power =
+      inv0["battery_real_power"].get<double>() +
+      inv1["battery_real_power"].get<double>();
+  total_system_battery_power =
+      std::round(total_system_battery_power * 100.0) / 100.0;
+
+  double total_system_estimate_ac_input_power =
+      inv0["ac_input_power_estimate"].get<double>() +
+      inv1["ac_input_power_estimate"].get<double>();
+  total_system_estimate_ac_input_power =
+      std::round(total_system_estimate_ac_input_power * 100.0) / 100.0;
+
+  int total_charging = inv0["battery_charging_current"].get<int>() +
+                       inv1["battery_charging_current"].get<int>();
+  int total_discharge = inv0["battery_discharge_current"].get<int>() +
+                        inv1["battery_discharge_current"].get<int>();
+  double avg_battery_voltage =
+      std::round((inv0["battery_voltage"].get<double>() +
+                  inv1["battery_voltage"].get<double>()) *
+                 50.0) /
+      100.0;
+  double total_system_load_percentage =
+      (inv0["load_percentage"].get<int>() +
+       inv1["load_percentage"].get<int>()) /
+      2.0;
+  double total_pv_current = inv0["pv_total_input_current"].get<double>() +
+                            inv1["pv_total_input_current"].get<double>();
+  total_pv_current = std::round(total_pv_current * 100.0) / 100.0;
+  double total_pv_power =
+      std::round((inv0["pv1_input_power"].get<double>() +
+                  inv0["pv2_input_power"].get<double>() +
+                  inv1["pv1_input_power"].get<double>() +
+                  inv1["pv2_input_power"].get<double>()) *
+                 100.0) /
+      100.0;
+  int system_status = (hasAnyAlarm(inv0) || hasAnyAlarm(inv1)) ? 1 : 0;
+
+  int total_ac_apparent = inv0["ac_output_apparent_power"].get<int>() +
+                          inv1["ac_output_apparent_power"].get<int>();
+  int total_ac_active = inv0["ac_output_active_power"].get<int>() +
+                        inv1["ac_output_active_power"].get<int>();
+  int total_ac_reactive = total_ac_apparent - total_ac_active;
+  int avg_battery_soc =
+      (inv0["battery_soc"].get<int>() + inv1["battery_soc"].get<int>()) / 2;
+  double avg_grid_voltage =
+      std::round((inv0["grid_input_voltage"].get<double>() +
+                  inv1["grid_input_voltage"].get<double>()) *
+                 100.0) /
+      100.0;
+  double avg_grid_frequency =
+      std::round((inv0["grid_input_frequency"].get<double>() +
+                  inv1["grid_input_frequency"].get<double>()) *
+                 100.0) /
+      100.0;
+
+  // === JSON DE TOTALES ===
+  json totals;
+  totals["total_system_battery_charging_current"] = total_charging;
+  totals["total_system_battery_discharge_current"] = total_discharge;
+  totals["total_system_battery_voltage"] = avg_battery_voltage;
+  totals["total_system_load_percentage"] = total_system_load_percentage;
+  totals["total_system_pv_input_current"] = total_pv_current;
+  totals["total_system_pv_input_power"] = total_pv_power;
+  totals["system_general_status"] = system_status;
+  totals["total_system_ac_output_apparent_power"] = total_ac_apparent;
+  totals["total_system_ac_output_active_power"] = total_ac_active;
+  totals["total_system_ac_output_reactive_power"] = total_ac_reactive;
+  totals["total_system_battery_soc"] = avg_battery_soc;
+  totals["total_system_grid_input_voltage"] = avg_grid_voltage;
+  totals["total_system_grid_input_frequency"] = avg_grid_frequency;
+
+  // 🔸 NUEVOS CAMPOS EN TOTALES
+  totals["total_system_battery_real_charge"] =
+      total_system_battery_real_charge;
+  totals["total_system_battery_power"] = total_system_battery_power;
+  totals["total_system_estimate_ac_input_power"] =
+      total_system_estimate_ac_input_power;
+
+  // 🔍 [OPCIONAL] Log de totales
+  logMessage("DEBUG total_system_battery_real_charge: " +
+             std::to_string(total_system_battery_real_charge));
+
+  g_watchdog.endStage();
+
+  // Publicar
+  g_watchdog.beginStage(STAGE_PUBLISH, mosquitto_socket(mosq));
+  bool published = publishMQTT(mosq, topicFor(TOPIC_INV0), inv0);
+  published &= publishMQTT(mosq, topicFor(TOPIC_INV1), inv1);
+  published &= publishMQTT(mosq, topicFor(TOPIC_TOTALS), totals);
+  if (g_config.rollup_enabled) {
+    addRollupSample(mosq, "inv01", ROLLUP_INVERTER_FIELDS, inv0, sampleTime);
+    addRollupSample(mosq, "inv02", ROLLUP_INVERTER_FIELDS, inv1, sampleTime);
+    addRollupSample(mosq, "totales", ROLLUP_TOTAL_FIELDS, totals, sampleTime);
   }
+  g_watchdog.endStage();
+  return published;
+}
 
-  out_fault_code = fields[3];
-  out_inverter_status = fields[19];
+// === Modo replay ===
+// Reinyecta una traza capturada en el mismo pipeline de decodificación,
+// agregación y publicación que el modo continuo, sin esperas. Solo publica
+// en el broker configurado si se pide con --publish, nunca con retain y
+// siempre bajo TOPIC_REPLAY_BASE.
+int runReplay(struct mosquitto *mosq, const std::string &tracePath,
+              bool useBroker) {
+  g_config = loadConfig();
+  g_publishRetained = false;
+  g_topicBase = TOPIC_REPLAY_BASE;
+  std::vector<TraceRecord> records;
+  try {
+    records = loadTrace(tracePath);
+  } catch (const std::exception &e) {
+    logMessage("❌ " + std::string(e.what()));
+    return 1;
+  }
+  logMessage("⏩ Replay de " + std::to_string(records.size()) +
+             " tramas desde: " + tracePath);
 
-  auto to_double = [](const std::string &s) -> double {
+  bool connected = false;
+  g_publishNullSink = !useBroker;
+  if (useBroker) {
+    if (!g_config.mqtt_user.empty()) {
+      mosquitto_username_pw_set(mosq, g_config.mqtt_user.c_str(),
+                                g_config.mqtt_password.c_str());
+    }
     try {
-      return std::stod(s);
-    } catch (...) {
-      return 0.0;
+      connectMQTT(mosq, MQTT_CONNECT_TIMEOUT_MS);
+      connected = true;
+    } catch (const std::exception &e) {
+      logMessage("⚠️ Replay sin broker MQTT: " + std::string(e.what()));
     }
-  };
-  auto to_int = [](const std::string &s) -> int {
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  size_t cycles = 0, errors = 0;
+  std::string resp[2];
+  bool have[2] = {false, false};
+  for (const auto &rec : records) {
+    if (rec.unit > 1)
+      continue;
     try {
-      return std::stoi(s);
-    } catch (...) {
-      return 0;
-    }
-  };
-  auto round2 = [](double value) -> double {
-    return std::round(value * 100.0) / 100.0;
-  };
-
-  // --- PV cálculos (campos 14, 25, 27) ---
-  double pv1_v = round2(to_double(fields[14]));      // PV1 voltage
-  double pv2_v = round2(to_double(fields[27]));      // PV2 voltage
-  double pv_total_i = round2(to_double(fields[25])); // Total PV current
-  double pv1_i = 0.0, pv2_i = 0.0;
-
-  if (pv1_v + pv2_v > 0.1) {
-    pv1_i = pv_total_i * (pv1_v / (pv1_v + pv2_v));
-    pv2_i = pv_total_i * (pv2_v / (pv1_v + pv2_v));
-  } else {
-    pv1_i = pv_total_i;
-    pv2_i = 0.0;
-  }
-  pv1_i = round2(pv1_i);
-  pv2_i = round2(pv2_i);
-  double pv1_p = round2(pv1_v * pv1_i);
-  double pv2_p = round2(pv2_v * pv2_i);
-
-  json j;
-  j["inverter_id"] = inverterId;
-  j["parallel_configuration"] = fields[0];
-  j["serial_number"] = fields[1];
-  j["work_mode"] = fields[2];
-  j["grid_input_voltage"] = round2(to_double(fields[4]));
-  j["grid_input_frequency"] = round2(to_double(fields[5]));
-  j["ac_output_voltage"] = round2(to_double(fields[6]));
-  j["ac_output_frequency"] = round2(to_double(fields[7]));
-  j["ac_output_apparent_power"] = to_int(fields[8]);
-  j["ac_output_active_power"] = to_int(fields[9]);
-
-  double ac_apparent = static_cast<double>(to_int(fields[8]));
-  double ac_active = static_cast<double>(to_int(fields[9]));
-  double ac_reactive = std::round((ac_apparent - ac_active) * 100.0) / 100.0;
-  j["ac_output_reactive_power"] = ac_reactive;
-
-  j["load_percentage"] = to_int(fields[10]);
-  j["battery_voltage"] = round2(to_double(fields[11]));
-  j["battery_charging_current"] = to_int(fields[12]);
-  j["battery_soc"] = to_int(fields[13]);
-  j["pv1_input_voltaje"] = pv1_v;
-  // 🔸 IMPORTANTE: LEER field[15] aunque no lo guardemos
-  int battery_total_charging =
-      to_int(fields[15]); // <-- Necesario para no desplazar índices
-  // j["battery_total_all_inputs_charging_current"] = battery_total_charging; //
-  // NO se incluye
-
-  j["output_mode"] = to_int(fields[20]);
-  j["charger_source_priority"] = to_int(fields[21]);
-  j["config_max_charger_current"] = to_int(fields[22]);
-  j["config_max_charge_range"] = to_int(fields[23]);
-  j["config_max_ac_charger_current"] =
-      to_int(fields[24]); // ← usado en cálculo AC power
-
-  j["pv_total_input_current"] =
-      pv_total_i; // ← Este se mantiene (reemplaza "total_inv_pv_input_current")
-  j["battery_discharge_current"] = to_int(fields[26]);
-  j["pv2_input_voltaje"] = pv2_v;
-  j["pv1_input_current"] = pv1_i;
-  j["pv2_input_current"] = pv2_i;
-  j["pv1_input_power"] = pv1_p;
-  j["pv2_input_power"] = pv2_p;
-
-  // 🔸 CALCULO: battery_real_charge_current
-  int charging = j["battery_charging_current"].get<int>();
-  int discharging = j["battery_discharge_current"].get<int>();
-  double battery_real_charge = 0.0;
-  if (charging > 0 && discharging == 0) {
-    battery_real_charge = static_cast<double>(charging);
-  } else if (charging == 0 && discharging > 0) {
-    battery_real_charge = -static_cast<double>(discharging);
-  } else if (charging > 0 && discharging > 0) {
-    battery_real_charge = static_cast<double>(charging - discharging);
-  }
-  battery_real_charge = round2(battery_real_charge);
-  j["battery_real_charge_current"] = battery_real_charge;
-
-  // 🔸 CALCULO: battery_real_power = real_charge * battery_voltage
-  double battery_voltage = j["battery_voltage"].get<double>();
-  double battery_real_power = round2(battery_real_charge * battery_voltage);
-  j["battery_real_power"] = battery_real_power;
-
-  // 🔸 CALCULO: ac_input_power_estimate = grid_voltage *
-  // config_max_ac_charger_current
-  double grid_voltage = j["grid_input_voltage"].get<double>();
-  int max_ac_charger = j["config_max_ac_charger_current"].get<int>();
-  double ac_input_power_estimate =
-      round2(grid_voltage * static_cast<double>(max_ac_charger));
-  j["ac_input_power_estimate"] = ac_input_power_estimate;
-
-  addFaultFlags(j, out_fault_code);
-  addInverterStatusFlags(j, out_inverter_status);
-  return j;
-}
+      if (rec.type == FRAME_TX) {
+        if (rec.unit == 0)
+          have[0] = have[1] = false;
+        continue;
+      }
+      if (rec.type == FRAME_RX_TIMEOUT)
+        throw std::runtime_error("Timeout en recepción");
+      if (rec.type != FRAME_RX)
+        continue; // Tardías y ruido: no son respuesta de ningún ciclo
+      resp[rec.unit] = decodeFrame(rec.data);
+      have[rec.unit] = true;
+      if (rec.unit == 1 && have[0]) {
+        processResponses(mosq, resp[0], resp[1],
+                         rec.timestamp_us / 1000000);
+        have[0] = have[1] = false;
+        ++cycles;
+      }
+    } catch (const std::exception &e) {
+      logMessage("⚠️ Error en ciclo: " + std::string(e.what()));
+      have[0] = have[1] = false;
+      ++errors;
+    }
+  }
 
-bool hasAnyAlarm(const json &j) {
-  std::vector<std::string> alarmFields = {"alarm_scc_loss",
-                                          "01_fan_locked",
-                                          "02_over_temperature",
-                                          "03_battery_voltage_high",
-                                          "04_battery_voltage_low",
-                                          "05_output_short_circuited",
-                                          "06_output_voltage_high",
-                                          "07_overload_timeout",
-                                          "08_bus_voltage_high",
-                                          "09_bus_soft_start_failed",
-                                          "10_pv_over_current",
-                                          "11_pv_over_voltage",
-                                          "12_dcdc_over_current",
-                                          "13_battery_discharge_over_current",
-                                          "51_over_current",
-                                          "52_bus_voltage_low",
-                                          "53_inverter_soft_start_failed",
-                                          "55_over_dc_voltage_in_ac_output",
-                                          "57_current_sensor_failed",
-                                          "58_output_voltage_low",
-                                          "60_power_feedback_protection",
-                                          "71_firmware_version_inconsistent",
-                                          "72_current_sharing_fault",
-                                          "80_can_fault",
-                                          "81_host_loss",
-                                          "82_synchronization_loss",
-                                          "83_battery_voltage_diff_parallel",
-                                          "84_ac_input_diff_parallel",
-                                          "85_ac_output_unbalance",
-                                          "86_ac_output_mode_diff"};
-  for (const auto &field : alarmFields) {
-    if (j.contains(field) && j[field] == 1) {
-      return true;
-    }
-  }
-  return false;
+  if (connected)
+    mosquitto_disconnect(mosq);
+  auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+  logMessage("✅ Replay completado: " + std::to_string(cycles) + " ciclos, " +
+             std::to_string(errors) + " errores en " +
+             std::to_string(elapsed_ms) + " ms");
+  if (g_publishNullSink) {
+    logMessage("📦 Payload serializado (sin broker): " +
+               std::to_string(g_nullSinkBytes) + " bytes");
+  }
+  logMessage("📊 Tiempos por etapa: " + g_watchdog.status()["stages"].dump());
+  return 0;
 }
 
 // === main ===
-int main() {
-  initLogger();
-  logMessage("🚀 Iniciando axpert_monitor en modo continuo (recarga config en "
-             "cada ciclo)...");
+int main(int argc, char **argv) {
+  std::string replayPath;
+  bool useBroker = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--replay" && i + 1 < argc) {
+      replayPath = argv[++i];
+    } else if (arg == "--publish") {
+      useBroker = true;
+    } else if (arg == "--healthcheck") {
+      return runHealthcheck();
+    } else {
+      std::cerr << "Uso: " << argv[0]
+                << " [--replay <traza> [--publish]] [--healthcheck]"
+                << std::endl;
+      return 2;
+    }
+  }
+
+  bool replay = !replayPath.empty();
+  initLogger(replay ? REPLAY_LOG_DIR : LOG_DIR);
 
   // --- Iniciar MQTT ---
+  // El replay usa su propio client id para no expulsar al demonio del broker
   mosquitto_lib_init();
-  struct mosquitto *mosq = mosquitto_new("axpert_monitor", true, nullptr);
+  struct mosquitto *mosq = mosquitto_new(
+      replay ? "axpert_monitor_replay" : "axpert_monitor", true, nullptr);
   if (!mosq) {
     logMessage("❌ Error al crear cliente MQTT");
     return 1;
   }
+  mosquitto_connect_callback_set(mosq, onConnect);
+
+  if (replay) {
+    int ret = runReplay(mosq, replayPath, useBroker);
+    mosquitto_destroy(mosq);
+    mosquitto_lib_cleanup();
+    return ret;
+  }
+
+  logMessage("🚀 Iniciando axpert_monitor en modo continuo (recarga config en "
+             "cada ciclo)...");
 
   // Bucle infinito
   while (true) {
     g_config = loadConfig();
+    g_watchdog.start(cycleDeadlineMs(g_config), maxOkAgeMs(g_config));
+    g_watchdog.beginCycle();
+    g_recorder.configure(g_config.capture_file,
+                         static_cast<uint64_t>(g_config.capture_max_mb) << 20);
 
     if (!g_config.mqtt_user.empty()) {
       mosquitto_username_pw_set(mosq, g_config.mqtt_user.c_str(),
                                 g_config.mqtt_password.c_str());
     }
 
-    int rc = mosquitto_connect(mosq, g_config.mqtt_broker_ip.c_str(),
-                               g_config.mqtt_broker_port, 60);
-    if (rc != MOSQ_ERR_SUCCESS) {
-      logMessage("❌ Fallo al conectar al broker MQTT: " +
-                 std::string(mosquitto_strerror(rc)));
+    std::string mqttError;
+    g_watchdog.beginStage(STAGE_CONNECT);
+    try {
+      connectMQTT(mosq, MQTT_CONNECT_TIMEOUT_MS);
+    } catch (const std::exception &e) {
+      mqttError = e.what();
+    }
+    g_watchdog.endStage();
+    if (!mqttError.empty()) {
+      logMessage("❌ Fallo al conectar al broker MQTT: " + mqttError);
+      g_watchdog.endCycle(false);
       std::this_thread::sleep_for(
           std::chrono::milliseconds(g_config.delay_between_cycles_ms));
       continue;
@@ -582,6 +1132,7 @@ int main() {
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) {
       logMessage("❌ Error al crear socket TCP");
+      g_watchdog.endCycle(false);
       std::this_thread::sleep_for(
           std::chrono::milliseconds(g_config.delay_between_cycles_ms));
       continue;
@@ -599,152 +1150,64 @@ int main() {
                   &server_addr.sin_addr) <= 0) {
       logMessage("❌ IP de inversor inválida: " + g_config.inverter1_tcp_ip);
       close(sockfd);
+      g_watchdog.endCycle(false);
       std::this_thread::sleep_for(
           std::chrono::milliseconds(g_config.delay_between_cycles_ms));
       continue;
     }
 
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) <
-        0) {
+    g_watchdog.beginStage(STAGE_CONNECT, sockfd);
+    bool conn = connectWithTimeout(sockfd, server_addr, TCP_CONNECT_TIMEOUT_MS);
+    g_watchdog.endStage();
+    if (!conn) {
       logMessage("❌ Fallo al conectar al conversor TCP/serial en " +
                  g_config.inverter1_tcp_ip + ":" +
                  std::to_string(g_config.inverter1_tcp_port));
       close(sockfd);
+      g_watchdog.endCycle(false);
       std::this_thread::sleep_for(
           std::chrono::milliseconds(g_config.delay_between_cycles_ms));
       continue;
     }
 
+    bool ok = false;
     try {
-      std::vector<uint8_t> cmd_qpgs0 = {0x51, 0x50, 0x47, 0x53,
-                                        0x30, 0x3f, 0xda, 0x0d};
-      std::vector<uint8_t> cmd_qpgs1 = {0x51, 0x50, 0x47, 0x53,
-                                        0x31, 0x2f, 0xbb, 0x0d};
-
-      std::string resp0 = sendCommandAndGetCleanResponse(sockfd, cmd_qpgs0);
+      // QPGS1 se pide aunque falle QPGS0: si la respuesta de QPGS0 llega
+      // tarde, el enlace la reconoce y no la toma por la de QPGS1
+      InverterLink link(sockfd);
+      std::string resp0, error0;
+      g_watchdog.beginStage(STAGE_REQUEST, sockfd);
+      try {
+        resp0 = link.transact(buildCommand("QPGS0"), 0);
+      } catch (const std::exception &e) {
+        error0 = e.what();
+      }
+      g_watchdog.endStage();
       std::this_thread::sleep_for(
           std::chrono::milliseconds(g_config.delay_between_inverters_ms));
-      std::string resp1 = sendCommandAndGetCleanResponse(sockfd, cmd_qpgs1);
-
-      std::string fault0, status0, fault1, status1;
-      json inv0 = parseQPGS(resp0, "QPGS0", fault0, status0);
-      json inv1 = parseQPGS(resp1, "QPGS1", fault1, status1);
-
-      // 🔍 [OPCIONAL] Logs de depuración (puedes comentarlos si no los
-      // necesitas)
-      logMessage(
-          "DEBUG inv0 battery_real_charge_current: " +
-          std::to_string(inv0["battery_real_charge_current"].get<double>()));
-      logMessage("DEBUG inv0 ac_input_power_estimate: " +
-                 std::to_string(inv0["ac_input_power_estimate"].get<double>()));
-      logMessage(
-          "DEBUG inv1 battery_real_charge_current: " +
-          std::to_string(inv1["battery_real_charge_current"].get<double>()));
-
-      // === CÁLCULOS ===
-      double total_system_battery_real_charge =
-          inv0["battery_real_charge_current"].get<double>() +
-          inv1["battery_real_charge_current"].get<double>();
-      total_system_battery_real_charge =
-          std::round(total_system_battery_real_charge * 100.0) / 100.0;
-
-      double total_system_battery_power =
-          inv0["battery_real_power"].get<double>() +
-          inv1["battery_real_power"].get<double>();
-      total_system_battery_power =
-          std::round(total_system_battery_power * 100.0) / 100.0;
-
-      double total_system_estimate_ac_input_power =
-          inv0["ac_input_power_estimate"].get<double>() +
-          inv1["ac_input_power_estimate"].get<double>();
-      total_system_estimate_ac_input_power =
-          std::round(total_system_estimate_ac_input_power * 100.0) / 100.0;
-
-      int total_charging = inv0["battery_charging_current"].get<int>() +
-                           inv1["battery_charging_current"].get<int>();
-      int total_discharge = inv0["battery_discharge_current"].get<int>() +
-                            inv1["battery_discharge_current"].get<int>();
-      double avg_battery_voltage =
-          std::round((inv0["battery_voltage"].get<double>() +
-                      inv1["battery_voltage"].get<double>()) *
-                     50.0) /
-          100.0;
-      double total_system_load_percentage =
-          (inv0["load_percentage"].get<int>() +
-           inv1["load_percentage"].get<int>()) /
-          2.0;
-      double total_pv_current = inv0["pv_total_input_current"].get<double>() +
-                                inv1["pv_total_input_current"].get<double>();
-      total_pv_current = std::round(total_pv_current * 100.0) / 100.0;
-      double total_pv_power =
-          std::round((inv0["pv1_input_power"].get<double>() +
-                      inv0["pv2_input_power"].get<double>() +
-                      inv1["pv1_input_power"].get<double>() +
-                      inv1["pv2_input_power"].get<double>()) *
-                     100.0) /
-          100.0;
-      int system_status = (hasAnyAlarm(inv0) || hasAnyAlarm(inv1)) ? 1 : 0;
-
-      int total_ac_apparent = inv0["ac_output_apparent_power"].get<int>() +
-                              inv1["ac_output_apparent_power"].get<int>();
-      int total_ac_active = inv0["ac_output_active_power"].get<int>() +
-                            inv1["ac_output_active_power"].get<int>();
-      int total_ac_reactive = total_ac_apparent - total_ac_active;
-      int avg_battery_soc =
-          (inv0["battery_soc"].get<int>() + inv1["battery_soc"].get<int>()) / 2;
-      double avg_grid_voltage =
-          std::round((inv0["grid_input_voltage"].get<double>() +
-                      inv1["grid_input_voltage"].get<double>()) *
-                     100.0) /
-          100.0;
-      double avg_grid_frequency =
-          std::round((inv0["grid_input_frequency"].get<double>() +
-                      inv1["grid_input_frequency"].get<double>()) *
-                     100.0) /
-          100.0;
-
-      // === JSON DE TOTALES ===
-      json totals;
-      totals["total_system_battery_charging_current"] = total_charging;
-      totals["total_system_battery_discharge_current"] = total_discharge;
-      totals["total_system_battery_voltage"] = avg_battery_voltage;
-      totals["total_system_load_percentage"] = total_system_load_percentage;
-      totals["total_system_pv_input_current"] = total_pv_current;
-      totals["total_system_pv_input_power"] = total_pv_power;
-      totals["system_general_status"] = system_status;
-      totals["total_system_ac_output_apparent_power"] = total_ac_apparent;
-      totals["total_system_ac_output_active_power"] = total_ac_active;
-      totals["total_system_ac_output_reactive_power"] = total_ac_reactive;
-      totals["total_system_battery_soc"] = avg_battery_soc;
-      totals["total_system_grid_input_voltage"] = avg_grid_voltage;
-      totals["total_system_grid_input_frequency"] = avg_grid_frequency;
-
-      // 🔸 NUEVOS CAMPOS EN TOTALES
-      totals["total_system_battery_real_charge"] =
-          total_system_battery_real_charge;
-      totals["total_system_battery_power"] = total_system_battery_power;
-      totals["total_system_estimate_ac_input_power"] =
-          total_system_estimate_ac_input_power;
-
-      // 🔍 [OPCIONAL] Log de totales
-      logMessage("DEBUG total_system_battery_real_charge: " +
-                 std::to_string(total_system_battery_real_charge));
-
-      // Publicar
-      publishMQTT(mosq, TOPIC_INV0, inv0);
-      publishMQTT(mosq, TOPIC_INV1, inv1);
-      publishMQTT(mosq, TOPIC_TOTALS, totals);
+      g_watchdog.beginStage(STAGE_REQUEST, sockfd);
+      std::string resp1 = link.transact(buildCommand("QPGS1"), 1);
+      g_watchdog.endStage();
+      if (!error0.empty())
+        throw std::runtime_error(error0);
+
+      ok = processResponses(mosq, resp0, resp1, std::time(nullptr));
 
     } catch (const std::exception &e) {
       logMessage("⚠️ Error en ciclo: " + std::string(e.what()));
     }
 
     close(sockfd);
+    g_watchdog.endCycle(ok);
+    g_watchdog.beginStage(STAGE_PUBLISH, mosquitto_socket(mosq));
+    publishMQTT(mosq, topicFor(TOPIC_MONITOR), g_watchdog.status());
+    g_watchdog.endStage();
     mosquitto_disconnect(mosq);
     std::this_thread::sleep_for(
         std::chrono::milliseconds(g_config.delay_between_cycles_ms));
   }
 
+  g_watchdog.stop();
   mosquitto_destroy(mosq);
   mosquitto_lib_cleanup();
   logMessage("✅ Finalizado.");
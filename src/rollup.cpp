@@ -0,0 +1,122 @@
+#include "rollup.h"
+
+#include <cmath>
+#include <string>
+
+const std::vector<RollupField> ROLLUP_INVERTER_FIELDS = {
+    {"grid_input_voltage", false},
+    {"grid_input_frequency", false},
+    {"ac_output_voltage", false},
+    {"ac_output_frequency", false},
+    {"ac_output_apparent_power", false},
+    {"ac_output_active_power", false},
+    {"ac_output_reactive_power", false},
+    {"load_percentage", false},
+    {"battery_voltage", false},
+    {"battery_charging_current", false},
+    {"battery_discharge_current", false},
+    {"battery_soc", false},
+    {"battery_real_charge_current", false},
+    {"battery_real_power", false},
+    {"pv1_input_voltaje", false},
+    {"pv2_input_voltaje", false},
+    {"pv1_input_current", false},
+    {"pv2_input_current", false},
+    {"pv1_input_power", false},
+    {"pv2_input_power", false},
+    {"pv_total_input_current", false},
+    {"ac_input_power_estimate", false},
+    {"alarm_scc_loss", true},
+    {"alarm_battery_health", true},
+    {"alarm_line_loss", true},
+    {"status_ac_charging", true},
+    {"status_solar_charging", true},
+    {"status_load_on", true},
+};
+
+const std::vector<RollupField> ROLLUP_TOTAL_FIELDS = {
+    {"total_system_battery_charging_current", false},
+    {"total_system_battery_discharge_current", false},
+    {"total_system_battery_voltage", false},
+    {"total_system_load_percentage", false},
+    {"total_system_pv_input_current", false},
+    {"total_system_pv_input_power", false},
+    {"total_system_ac_output_apparent_power", false},
+    {"total_system_ac_output_active_power", false},
+    {"total_system_ac_output_reactive_power", false},
+    {"total_system_battery_soc", false},
+    {"total_system_grid_input_voltage", false},
+    {"total_system_grid_input_frequency", false},
+    {"total_system_battery_real_charge", false},
+    {"total_system_battery_power", false},
+    {"total_system_estimate_ac_input_power", false},
+    {"system_general_status", true},
+};
+
+json RollupBucket::toJson(const std::vector<RollupField> &schema,
+                          int windowSeconds) const {
+  auto round2 = [](double v) { return std::round(v * 100.0) / 100.0; };
+  json j;
+  for (size_t i = 0; i < schema.size(); ++i) {
+    const FieldAggregate &f = fields[i];
+    if (f.count == 0)
+      continue;
+    std::string name = schema[i].name;
+    j[name + "_max"] = round2(f.max);
+    if (schema[i].flag)
+      continue;
+    j[name + "_min"] = round2(f.min);
+    j[name + "_mean"] = round2(f.sum / f.count);
+    j[name + "_last"] = round2(f.last);
+  }
+  j["window_s"] = windowSeconds;
+  j["window_start"] = start;
+  j["samples"] = samples;
+  return j;
+}
+
+void RollupSeries::add(const json &sample, std::time_t t,
+                       std::vector<std::pair<int, json>> &closed) {
+  std::time_t minute = t - (t % ROLLUP_BUCKET_S);
+  RollupBucket &current = ring_[slot(current_)];
+  // Si el reloj retrocede (p. ej. corrección NTP sin RTC), la muestra se
+  // suma al minuto abierto: reabrir uno anterior lo publicaría dos veces
+  if (current.samples > 0 && minute < current_)
+    minute = current_;
+  if (current.samples > 0 && minute != current_) {
+    closed.emplace_back(ROLLUP_BUCKET_S,
+                        current.toJson(schema_, ROLLUP_BUCKET_S));
+    const std::time_t block = ROLLUP_BUCKET_S * ROLLUP_BUCKETS;
+    if (minute / block != current_ / block)
+      closed.emplace_back(block, mergeBlock(current_ - (current_ % block)));
+  }
+  current_ = minute;
+
+  RollupBucket &bucket = ring_[slot(minute)];
+  if (bucket.start != minute) {
+    bucket.start = minute;
+    bucket.samples = 0;
+    bucket.fields.assign(schema_.size(), FieldAggregate());
+  }
+  ++bucket.samples;
+  for (size_t i = 0; i < schema_.size(); ++i) {
+    auto it = sample.find(schema_[i].name);
+    if (it != sample.end() && it->is_number())
+      bucket.fields[i].add(it->get<double>());
+  }
+}
+
+json RollupSeries::mergeBlock(std::time_t blockStart) const {
+  RollupBucket merged;
+  merged.start = blockStart;
+  merged.fields.resize(schema_.size());
+  for (const auto &bucket : ring_) {
+    if (bucket.samples == 0 || bucket.start < blockStart ||
+        bucket.start >= blockStart + ROLLUP_BUCKET_S * ROLLUP_BUCKETS)
+      continue;
+    merged.samples += bucket.samples;
+    for (size_t i = 0; i < schema_.size(); ++i)
+      merged.fields[i].merge(bucket.fields[i]);
+  }
+  return merged.toJson(schema_, ROLLUP_BUCKET_S * ROLLUP_BUCKETS);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+// Rollups para almacenamiento a largo plazo: mínimo, máximo, media y último
+// valor de cada magnitud en ventanas de 1 y 15 minutos alineadas con el reloj.
+// Cada serie guarda un anillo de 15 cubos de 1 minuto. Cada muestra
+// actualiza solo el cubo del minuto en curso (O(1) por campo); al cerrar un
+// minuto se devuelve ese cubo y al cerrar un bloque de 15 minutos se combinan
+// los 15 cubos del anillo.
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <ctime>
+#include <nlohmann/json.hpp>
+#include <utility>
+#include <vector>
+
+using json = nlohmann::json;
+
+const int ROLLUP_BUCKET_S = 60;
+const int ROLLUP_BUCKETS = 15;
+
+// Solo se agregan las magnitudes medidas; de los indicadores de alarma y
+// estado basta el máximo (si se activaron en la ventana). Los códigos de
+// fallo y la configuración siguen en los tópicos a resolución completa.
+struct RollupField {
+  const char *name;
+  bool flag;
+};
+
+extern const std::vector<RollupField> ROLLUP_INVERTER_FIELDS;
+extern const std::vector<RollupField> ROLLUP_TOTAL_FIELDS;
+
+struct FieldAggregate {
+  double min = 0.0;
+  double max = 0.0;
+  double sum = 0.0;
+  double last = 0.0;
+  size_t count = 0;
+
+  void add(double value) {
+    if (count == 0 || value < min)
+      min = value;
+    if (count == 0 || value > max)
+      max = value;
+    sum += value;
+    last = value;
+    ++count;
+  }
+
+  void merge(const FieldAggregate &other) {
+    if (other.count == 0)
+      return;
+    min = (count == 0) ? other.min : std::min(min, other.min);
+    max = (count == 0) ? other.max : std::max(max, other.max);
+    sum += other.sum;
+    last = other.last;
+    count += other.count;
+  }
+};
+
+// `fields` va indexado igual que la lista de campos de la serie.
+struct RollupBucket {
+  std::time_t start = 0;
+  size_t samples = 0;
+  std::vector<FieldAggregate> fields;
+
+  json toJson(const std::vector<RollupField> &schema, int windowSeconds) const;
+};
+
+class RollupSeries {
+public:
+  explicit RollupSeries(const std::vector<RollupField> &schema)
+      : schema_(schema) {}
+
+  // Añade una muestra. Si cierra ventanas anteriores, las devuelve en
+  // `closed` como pares (ventana en segundos, agregado).
+  void add(const json &sample, std::time_t t,
+           std::vector<std::pair<int, json>> &closed);
+
+private:
+  static size_t slot(std::time_t minute) {
+    return (minute / ROLLUP_BUCKET_S) % ROLLUP_BUCKETS;
+  }
+
+  json mergeBlock(std::time_t blockStart) const;
+
+  const std::vector<RollupField> &schema_;
+  std::array<RollupBucket, ROLLUP_BUCKETS> ring_;
+  std::time_t current_ = 0;
+};
@@ -0,0 +1,332 @@
+// Pruebas de la biblioteca de decodificación y rollups (axpert_decode).
+// Sin framework: cada CHECK fallido se informa y el programa sale con 1.
+
+#include "decode.h"
+#include "rollup.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static int g_failures = 0;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ")"         \
+                << std::endl;                                                  \
+      ++g_failures;                                                            \
+    }                                                                          \
+  } while (0)
+
+static bool throws(const std::function<void()> &fn) {
+  try {
+    fn();
+  } catch (const std::exception &) {
+    return true;
+  }
+  return false;
+}
+
+// Construye "(<payload><crc>" tal y como lo envía el inversor (sin CR).
+static std::string makeFrame(const std::string &payload) {
+  std::string frame = "(" + payload;
+  uint16_t crc = crc16Voltronic(
+      reinterpret_cast<const uint8_t *>(frame.data()), frame.size());
+  frame += static_cast<char>(crc >> 8);
+  frame += static_cast<char>(crc & 0xff);
+  return frame;
+}
+
+static uint16_t crcOf(const std::string &s) {
+  return crc16Voltronic(reinterpret_cast<const uint8_t *>(s.data()), s.size());
+}
+
+static void testCrc() {
+  CHECK(crcOf("QPGS0") == 0x3FDA);
+  CHECK(crcOf("QPGS1") == 0x2FFB);
+  CHECK(crcOf("QPIGS") == 0xB7A9);
+
+  std::vector<uint8_t> cmd = buildCommand("QPGS0");
+  std::vector<uint8_t> expected = {'Q', 'P', 'G', 'S', '0', 0x3F, 0xDA, 0x0D};
+  CHECK(cmd == expected);
+  cmd = buildCommand("QPIGS");
+  CHECK(cmd.size() == 8 && cmd[5] == 0xB7 && cmd[6] == 0xA9 && cmd[7] == 0x0D);
+}
+
+static void testDecodeFrame() {
+  const std::string payload = "1 92932004102443 B 00 230.0";
+  std::string frame = makeFrame(payload);
+  CHECK(decodeFrame(frame) == payload);
+
+  // Basura previa, incluido otro '(' de una trama incompleta
+  CHECK(decodeFrame(std::string("\x00\xff(NA", 5) + frame) == payload);
+
+  std::string bad = frame;
+  bad[3] ^= 0x01;
+  CHECK(throws([&] { decodeFrame(bad); }));
+
+  std::string truncated = frame.substr(0, frame.size() - 1);
+  CHECK(throws([&] { decodeFrame(truncated); }));
+  CHECK(throws([&] { decodeFrame("(A"); }));
+  CHECK(throws([&] { decodeFrame("sin inicio"); }));
+}
+
+static void testFrameDecoderChunks() {
+  std::string a = makeFrame("1 92932004102443 B 00");
+  std::string b = makeFrame("1 92932004102441 L 00");
+  std::string stream = "ruido\r" + a + "\r" + b + "\r";
+
+  // Mismo resultado con cualquier tamaño de lectura
+  for (size_t chunk = 1; chunk <= stream.size(); ++chunk) {
+    FrameDecoder decoder;
+    std::vector<std::string> segments;
+    std::string segment;
+    for (size_t pos = 0; pos < stream.size(); pos += chunk) {
+      std::string part = stream.substr(pos, chunk);
+      decoder.feed(part.data(), part.size());
+      while (decoder.next(segment))
+        segments.push_back(segment);
+    }
+    CHECK(segments.size() == 3);
+    if (segments.size() == 3) {
+      CHECK(segments[0] == "ruido");
+      CHECK(decodeFrame(segments[1]) == "1 92932004102443 B 00");
+      CHECK(decodeFrame(segments[2]) == "1 92932004102441 L 00");
+    }
+    CHECK(decoder.partial().empty());
+  }
+}
+
+static void testFrameDecoderOverflow() {
+  // Un '(' al inicio seguido de basura sin CR no debe crecer sin límite
+  FrameDecoder decoder;
+  std::string junk = "(" + std::string(25600, 'x');
+  for (size_t pos = 0; pos < junk.size(); pos += 256)
+    decoder.feed(junk.data() + pos, std::min<size_t>(256, junk.size() - pos));
+  CHECK(decoder.partial().size() <= MAX_FRAME_SIZE);
+  // Lo descartado se puede recoger para grabarlo
+  std::string discarded;
+  CHECK(decoder.takeDiscarded(discarded));
+  CHECK(discarded.size() + decoder.partial().size() == junk.size());
+  CHECK(!decoder.takeDiscarded(discarded));
+
+  // Tras la basura, una trama válida se sigue decodificando
+  std::string frame = makeFrame("1 92932004102443 B 00") + "\r";
+  decoder.feed(frame.data(), frame.size());
+  std::string segment;
+  CHECK(decoder.next(segment));
+  CHECK(!throws([&] { decodeFrame(segment); }));
+  CHECK(decoder.partial().empty());
+}
+
+static void testResponseMatcherLate() {
+  std::string late = makeFrame("1 92932004102443 B 00");
+  std::string current = makeFrame("1 92932004102441 L 00");
+  ResponseMatcher matcher;
+  uint8_t owner = 0;
+
+  // QPGS0 vence sin respuesta, se pide QPGS1 y llega primero la de QPGS0
+  matcher.sent(0, 0);
+  matcher.sent(1, 6000);
+  CHECK(matcher.match("ruido", 1, owner) == ResponseMatcher::MATCH_NOISE);
+  CHECK(matcher.match(late, 1, owner) == ResponseMatcher::MATCH_LATE);
+  CHECK(owner == 0);
+  CHECK(matcher.match(current, 1, owner) == ResponseMatcher::MATCH_CURRENT);
+  CHECK(owner == 1);
+  CHECK(matcher.pending() == 0);
+  CHECK(matcher.match(current, -1, owner) ==
+        ResponseMatcher::MATCH_UNSOLICITED);
+
+  // Una petición abandonada hace demasiado se olvida; la última nunca
+  matcher.sent(0, 0);
+  matcher.sent(1, 20000);
+  matcher.expire(20000, 10000);
+  CHECK(matcher.pending() == 1);
+  CHECK(matcher.match(current, 1, owner) == ResponseMatcher::MATCH_CURRENT);
+  matcher.sent(1, 0);
+  matcher.expire(60000, 10000);
+  CHECK(matcher.pending() == 1);
+}
+
+static void testLoadTraceTruncated() {
+  const std::string path = "decode_test_trace.bin";
+  TraceRecord first;
+  first.timestamp_us = 1792000000000000ULL;
+  first.type = FRAME_TX;
+  first.unit = 1;
+  first.data = "QPGS1";
+  TraceRecord second = first;
+  second.type = FRAME_RX;
+  second.data = makeFrame("1 92932004102441 L 00");
+
+  std::vector<uint8_t> bytes = encodeTraceHeader();
+  std::vector<uint8_t> rec = encodeTraceRecord(first);
+  bytes.insert(bytes.end(), rec.begin(), rec.end());
+  rec = encodeTraceRecord(second);
+  bytes.insert(bytes.end(), rec.begin(), rec.end() - 3); // cortado
+
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+  }
+  std::vector<TraceRecord> records = loadTrace(path);
+  CHECK(records.size() == 1);
+  // Solo cuentan la cabecera y el registro completo
+  CHECK(traceValidSize(path) ==
+        TRACE_HEADER_SIZE + TRACE_RECORD_HEADER_SIZE + first.data.size());
+  if (records.size() == 1) {
+    CHECK(records[0].timestamp_us == first.timestamp_us);
+    CHECK(records[0].type == FRAME_TX);
+    CHECK(records[0].unit == 1);
+    CHECK(records[0].data == "QPGS1");
+  }
+
+  // Solo la mitad de la cabecera
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write("AXTR", 4);
+  }
+  CHECK(throws([&] { loadTrace(path); }));
+  CHECK(traceValidSize(path) == 0);
+  std::remove(path.c_str());
+  CHECK(traceValidSize(path) == 0);
+}
+
+// Serie de prueba: una magnitud y un indicador
+static const std::vector<RollupField> TEST_FIELDS = {{"power", false},
+                                                     {"alarm", true}};
+static const std::time_t T0 = 900000; // Múltiplo de 900: inicio de bloque
+
+static json sample(double power, int alarm) {
+  json j;
+  j["power"] = power;
+  j["alarm"] = alarm;
+  j["serial_number"] = "92932004102443"; // No numérico: se ignora
+  return j;
+}
+
+static void testRollupMinuteClose() {
+  RollupSeries series(TEST_FIELDS);
+  std::vector<std::pair<int, json>> closed;
+  series.add(sample(100, 0), T0, closed);
+  series.add(sample(300, 1), T0 + 30, closed);
+  series.add(sample(200, 0), T0 + 59, closed);
+  CHECK(closed.empty());
+
+  series.add(sample(50, 0), T0 + 60, closed);
+  CHECK(closed.size() == 1);
+  if (closed.size() == 1) {
+    const json &w = closed[0].second;
+    CHECK(closed[0].first == 60);
+    CHECK(w["window_start"] == T0);
+    CHECK(w["samples"] == 3);
+    CHECK(w["power_min"] == 100.0);
+    CHECK(w["power_max"] == 300.0);
+    CHECK(w["power_mean"] == 200.0);
+    CHECK(w["power_last"] == 200.0);
+    // Los indicadores solo publican el máximo
+    CHECK(w["alarm_max"] == 1.0);
+    CHECK(!w.contains("alarm_min") && !w.contains("alarm_mean") &&
+          !w.contains("alarm_last"));
+    CHECK(!w.contains("serial_number_max"));
+  }
+}
+
+static void testRollupBlockClose() {
+  RollupSeries series(TEST_FIELDS);
+  std::vector<std::pair<int, json>> closed;
+  for (int minute = 0; minute < 15; ++minute)
+    series.add(sample(minute, minute == 7), T0 + minute * 60, closed);
+  CHECK(closed.size() == 14);
+  closed.clear();
+
+  series.add(sample(1000, 0), T0 + 900, closed);
+  CHECK(closed.size() == 2);
+  if (closed.size() == 2) {
+    CHECK(closed[0].first == 60);
+    CHECK(closed[0].second["window_start"] == T0 + 14 * 60);
+    const json &w = closed[1].second;
+    CHECK(closed[1].first == 900);
+    CHECK(w["window_start"] == T0);
+    CHECK(w["samples"] == 15);
+    CHECK(w["power_min"] == 0.0);
+    CHECK(w["power_max"] == 14.0);
+    CHECK(w["power_mean"] == 7.0);
+    CHECK(w["power_last"] == 14.0);
+    CHECK(w["alarm_max"] == 1.0);
+  }
+}
+
+static void testRollupGapReusesSlot() {
+  RollupSeries series(TEST_FIELDS);
+  std::vector<std::pair<int, json>> closed;
+  series.add(sample(10, 0), T0 + 5 * 60, closed);
+  series.add(sample(20, 0), T0 + 6 * 60, closed);
+  closed.clear();
+
+  // 16 minutos después: mismo hueco del anillo que el minuto 6, otro bloque
+  series.add(sample(30, 0), T0 + 21 * 60, closed);
+  CHECK(closed.size() == 2);
+  if (closed.size() == 2) {
+    CHECK(closed[0].second["window_start"] == T0 + 6 * 60);
+    CHECK(closed[1].second["window_start"] == T0);
+    CHECK(closed[1].second["samples"] == 2);
+  }
+  closed.clear();
+
+  // El bloque nuevo no arrastra los cubos viejos del anillo
+  series.add(sample(40, 0), T0 + 30 * 60, closed);
+  CHECK(closed.size() == 2);
+  if (closed.size() == 2) {
+    const json &w = closed[1].second;
+    CHECK(w["window_start"] == T0 + 900);
+    CHECK(w["samples"] == 1);
+    CHECK(w["power_min"] == 30.0);
+    CHECK(w["power_max"] == 30.0);
+  }
+}
+
+static void testRollupClockBackwards() {
+  RollupSeries series(TEST_FIELDS);
+  std::vector<std::pair<int, json>> closed;
+  series.add(sample(1, 0), T0, closed);
+  series.add(sample(2, 0), T0 + 60, closed);
+  series.add(sample(3, 0), T0 + 5, closed); // El reloj retrocede
+  series.add(sample(4, 0), T0 + 120, closed);
+
+  // Cada minuto se publica una sola vez; la muestra atrasada va al abierto
+  CHECK(closed.size() == 2);
+  if (closed.size() == 2) {
+    CHECK(closed[0].second["window_start"] == T0);
+    CHECK(closed[0].second["samples"] == 1);
+    CHECK(closed[1].second["window_start"] == T0 + 60);
+    CHECK(closed[1].second["samples"] == 2);
+    CHECK(closed[1].second["power_last"] == 3.0);
+  }
+}
+
+int main() {
+  testCrc();
+  testDecodeFrame();
+  testFrameDecoderChunks();
+  testFrameDecoderOverflow();
+  testResponseMatcherLate();
+  testLoadTraceTruncated();
+  testRollupMinuteClose();
+  testRollupBlockClose();
+  testRollupGapReusesSlot();
+  testRollupClockBackwards();
+  if (g_failures > 0) {
+    std::cerr << g_failures << " comprobaciones fallidas" << std::endl;
+    return 1;
+  }
+  std::cout << "OK" << std::endl;
+  return 0;
+}
@@ -0,0 +1,118 @@
+// Genera una traza QPGS sintética y determinista para el benchmark y el
+// entrenamiento de PGO cuando no hay capturas reales en traces/.
+//
+// Uso: axpert_gen_corpus <salida.bin> [segundos]
+//
+// Simula dos inversores en paralelo a un ciclo cada 5 s, con curva solar
+// diaria, carga/descarga de batería y, de vez en cuando, códigos de fallo,
+// tramas corruptas, timeouts, ruido y respuestas tardías, para que el replay
+// recorra las mismas ramas que en producción.
+
+#include "decode.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+static const uint64_t START_US = 1792000000ULL * 1000000ULL;
+static const int CYCLE_S = 5;
+
+static std::string frameFor(const std::string &payload) {
+  std::string frame = "(" + payload;
+  uint16_t crc = crc16Voltronic(
+      reinterpret_cast<const uint8_t *>(frame.data()), frame.size());
+  frame += static_cast<char>(crc >> 8);
+  frame += static_cast<char>(crc & 0xff);
+  return frame;
+}
+
+static std::string qpgsPayload(int unit, long cycle, double t) {
+  const double kPi = 3.14159265358979323846;
+  double day = std::fmod(t, 86400.0) / 86400.0;
+  double sun = std::max(0.0, std::sin((day - 0.25) * 2.0 * kPi));
+  double pv1_v = sun > 0.0 ? 280.0 + 60.0 * sun : 0.0;
+  double pv2_v = sun > 0.0 ? 260.0 + 50.0 * sun : 0.0;
+  int pv_i = static_cast<int>(std::lround(18.0 * sun)) + unit;
+  int load = 800 + static_cast<int>(400.0 * std::sin(cycle * 0.013 + unit));
+  int apparent = load + 60;
+  int soc = 40 + static_cast<int>(50.0 * sun);
+  int charging = sun > 0.3 ? static_cast<int>(30.0 * sun) : 0;
+  int discharging = charging == 0 ? load / 50 : 0;
+  double batt_v = 48.0 + 0.06 * soc;
+  int fault = (cycle % 997 == 0) ? 4 : 0;
+  const char *status = (charging > 0) ? "00110010" : "00000010";
+
+  char buf[256];
+  std::snprintf(buf, sizeof(buf),
+                "1 9293200410244%d %s %02d 230.%d 50.00 230.0 50.00 %04d %04d "
+                "%03d %.1f %03d %03d %05.1f %03d %05d %05d %03d %s 1 2 030 060 "
+                "10 %03d %03d %05.1f",
+                unit, fault ? "F" : "B", fault, static_cast<int>(cycle % 10),
+                apparent, load, load / 50, batt_v, charging, soc, pv1_v,
+                charging, apparent * 2, load * 2, 36, status, pv_i,
+                discharging, pv2_v);
+  return buf;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "Uso: " << argv[0] << " <salida.bin> [segundos]" << std::endl;
+    return 2;
+  }
+  long seconds = (argc > 2) ? std::atol(argv[2]) : 86400;
+  std::ofstream out(argv[1], std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    std::cerr << "No se pudo crear " << argv[1] << std::endl;
+    return 1;
+  }
+  auto write = [&](const TraceRecord &rec) {
+    std::vector<uint8_t> bytes = encodeTraceRecord(rec);
+    out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+  };
+  std::vector<uint8_t> header = encodeTraceHeader();
+  out.write(reinterpret_cast<const char *>(header.data()), header.size());
+
+  for (long cycle = 0; cycle < seconds / CYCLE_S; ++cycle) {
+    uint64_t ts = START_US + cycle * CYCLE_S * 1000000ULL;
+    for (int unit = 0; unit < 2; ++unit) {
+      TraceRecord tx;
+      tx.timestamp_us = ts + unit * 1100000ULL;
+      tx.type = FRAME_TX;
+      tx.unit = unit;
+      std::vector<uint8_t> cmd = buildCommand("QPGS" + std::to_string(unit));
+      tx.data.assign(cmd.begin(), cmd.end());
+      write(tx);
+
+      TraceRecord rx = tx;
+      rx.timestamp_us += 90000;
+      rx.type = FRAME_RX;
+      std::string frame =
+          frameFor(qpgsPayload(unit, cycle, static_cast<double>(ts) / 1e6));
+      if (cycle % 211 == 0 && unit == 1) {
+        rx.type = FRAME_RX_TIMEOUT; // Respuesta parcial
+        frame.resize(frame.size() / 2);
+      } else if (cycle % 307 == 0) {
+        frame[10] ^= 0x01; // CRC inválido
+      } else if (cycle % 503 == 0) {
+        TraceRecord noise = rx; // Ruido de línea antes de la respuesta
+        noise.type = FRAME_RX_NOISE;
+        noise.data = std::string("\x00\xfe\x7f", 3);
+        write(noise);
+      } else if (cycle % 401 == 0 && unit == 0) {
+        TraceRecord late = rx; // Respuesta tardía del ciclo anterior
+        late.type = FRAME_RX_LATE;
+        late.data = frameFor(qpgsPayload(1, cycle - 1, 0.0));
+        write(late);
+      }
+      rx.data = frame;
+      write(rx);
+      if (rx.type == FRAME_RX_TIMEOUT)
+        break;
+    }
+  }
+  return out.good() ? 0 : 1;
+}
@@ -88,6 +88,9 @@ def send_to_inverter(command, ip, port, timeout=2):
 class Handler(http.server.SimpleHTTPRequestHandler):
     def translate_path(self, path):
         parsed = urlparse(path)
+        if parsed.path == '/status':
+            # Estado del supervisor escrito por axpert_monitor en cada ciclo
+            return '/app/log/status.json'
         if parsed.path.startswith('/config/'):
             rel = os.path.relpath(parsed.path, '/config')
             return os.path.join('/app/config', rel)